@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "../src/encoder.hpp"
+#include "../src/generation.hpp"
+#include "../src/parser.hpp"
+#include "../src/stats.hpp"
+#include "../src/tokenization.hpp"
+
+// Compiler throughput on synthetic inputs. Every workload is generated in memory, the
+// same for every run, and pushed through the tokenizer, the parser, the -O1 code
+// generator and the encoder, each timed on its own. Every phase runs --reps times after
+// one warm-up and the median counts, so one preempted run doesn't move the result.
+//
+//   pigeon_bench [--scale <factor>] [--reps <n>] [--filter <workload>]
+//                [--save <file>] [--baseline <file> [--threshold <percent>]]
+//
+// --save writes the medians to a file, --baseline compares against such a file and
+// fails if any phase got slower by more than --threshold percent (default 10).
+
+struct Workload {
+    const char* name;
+    std::function<std::string()> generate;
+};
+
+// One statement per line, mixing every operator over a handful of variables.
+static std::string gen_statements(size_t count) {
+    std::string src = "let a = 1;\nlet b = 2;\nlet c = 3;\n";
+    const char* vars[] = {"a", "b", "c"};
+    for (size_t i = 0; i < count; i++) {
+        std::string k = std::to_string(i % 97 + 1);
+        src += std::string(vars[i % 3]) + " = " + vars[(i + 1) % 3] + " * " + k + " + " + vars[(i + 2) % 3] + " / "
+            + k + " - " + k + ";\n";
+    }
+    src += "exit(a + b + c);\n";
+    return src;
+}
+
+// count statements of depth nested parentheses each.
+static std::string gen_nested_parens(size_t count, size_t depth) {
+    std::string src = "let x = 0;\n";
+    for (size_t i = 0; i < count; i++) {
+        src += "x = ";
+        src.append(depth, '(');
+        src += "x";
+        for (size_t j = 0; j < depth; j++) {
+            src += j % 2 == 0 ? " + 1)" : " * 3)";
+        }
+        src += ";\n";
+    }
+    src += "exit(x);\n";
+    return src;
+}
+
+// count nests of depth scopes that each declare vars variables, initialized from the
+// ones a level further out.
+static std::string gen_scopes(size_t count, size_t depth, size_t vars) {
+    std::string src = "let sum = 0;\n";
+    for (size_t i = 0; i < count; i++) {
+        for (size_t d = 0; d < depth; d++) {
+            src += "{\n";
+            for (size_t v = 0; v < vars; v++) {
+                std::string init = d == 0 ? std::to_string(v) : "v" + std::to_string(d - 1) + "x" + std::to_string(v) + " + 1";
+                src += "let v" + std::to_string(d) + "x" + std::to_string(v) + " = " + init + ";\n";
+            }
+            src += "sum = sum + v" + std::to_string(d) + "x0;\n";
+        }
+        src.append(depth, '}');
+        src += "\n";
+    }
+    src += "exit(sum);\n";
+    return src;
+}
+
+// count print statements of args arguments each.
+static std::string gen_prints(size_t count, size_t args) {
+    std::string src = "let c = 65;\n";
+    for (size_t i = 0; i < count; i++) {
+        src += "print(";
+        for (size_t j = 0; j < args; j++) {
+            src += j == 0 ? "" : ", ";
+            src += j % 4 == 0 ? "c" : std::to_string(65 + j % 26);
+        }
+        src += ");\n";
+    }
+    src += "exit(0);\n";
+    return src;
+}
+
+// count nests of depth ifs each, with a statement at every level.
+static std::string gen_ifs(size_t count, size_t depth) {
+    std::string src = "let x = 1;\n";
+    for (size_t i = 0; i < count; i++) {
+        for (size_t d = 0; d < depth; d++) {
+            src += "if (x < " + std::to_string(d + 2) + ") {\nx = x + 1;\n";
+        }
+        src.append(depth, '}');
+        src += "\nx = 1;\n";
+    }
+    src += "exit(x);\n";
+    return src;
+}
+
+static std::vector<Workload> workloads(double scale) {
+    auto n = [scale](size_t base) {
+        return std::max<size_t>(1, static_cast<size_t>(static_cast<double>(base) * scale));
+    };
+    return {
+        {"statements", [=] { return gen_statements(n(1000000)); }},
+        // deep enough that a recursive parser or generator would run out of stack
+        {"nested_parens", [=] { return gen_nested_parens(n(8), 50000); }},
+        {"scopes", [=] { return gen_scopes(n(50), 100, 50); }},
+        {"prints", [=] { return gen_prints(n(500), 2000); }},
+        {"ifs", [=] { return gen_ifs(n(2000), 100); }},
+    };
+}
+
+struct Phase {
+    const char* name;
+    const char* unit;   // what throughput counts
+    size_t items;
+    double median_ms;
+    double min_ms;
+};
+
+template<typename Run>
+static Phase measure(const char* name, const char* unit, size_t reps, Run run) {
+    size_t items = run();
+    std::vector<double> times;
+    for (size_t i = 0; i < reps; i++) {
+        double start = PassClock::now(CLOCK_MONOTONIC);
+        run();
+        times.push_back(PassClock::now(CLOCK_MONOTONIC) - start);
+    }
+    std::sort(times.begin(), times.end());
+    return {.name = name, .unit = unit, .items = items, .median_ms = times[times.size() / 2], .min_ms = times.front()};
+}
+
+static std::vector<Phase> bench(const std::string& source, size_t reps) {
+    Interner interner;
+    std::vector<Token> tokens;
+    std::vector<Phase> phases;
+    phases.push_back(measure("tokenize", "tokens", reps, [&] {
+        interner.clear();
+        Tokenizer tokenizer(source, interner);
+        tokens = tokenizer.tokenize();
+        return tokens.size();
+    }));
+
+    Parser parser(std::vector<Token> {}, source);
+    phases.push_back(measure("parse", "nodes", reps, [&] {
+        // the copy is part of every rep, but small next to the parse
+        parser = Parser(tokens, source);
+        return parser.parse_prog().nodes.size();
+    }));
+
+    Generator generator(parser.ast(), interner);
+    const Assembly* assembly = nullptr;
+    phases.push_back(measure("codegen", "instrs", reps, [&] {
+        assembly = &generator.gen_prog();
+        return assembly->instrs.size();
+    }));
+
+    X86Encoder encoder;
+    phases.push_back(measure("encode", "bytes", reps, [&] {
+        encoder.encode(assembly->instrs);
+        return encoder.code().size();
+    }));
+    return phases;
+}
+
+static std::map<std::string, double> load_baseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream in(path);
+    std::string key;
+    double ms;
+    while (in >> key >> ms) {
+        baseline[key] = ms;
+    }
+    return baseline;
+}
+
+static int usage() {
+    std::cerr << "pigeon_bench [--scale <factor>] [--reps <n>] [--filter <workload>]" << std::endl;
+    std::cerr << "             [--save <file>] [--baseline <file> [--threshold <percent>]]" << std::endl;
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    double scale = 1;
+    size_t reps = 5;
+    double threshold = 10;
+    std::string filter;
+    std::string save;
+    std::string baseline_path;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--scale" && i + 1 < argc) {
+            scale = std::stod(argv[++i]);
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::max<size_t>(1, std::stoul(argv[++i]));
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg == "--save" && i + 1 < argc) {
+            save = argv[++i];
+        } else if (arg == "--baseline" && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (arg == "--threshold" && i + 1 < argc) {
+            threshold = std::stod(argv[++i]);
+        } else {
+            return usage();
+        }
+    }
+    std::map<std::string, double> baseline;
+    if (!baseline_path.empty()) {
+        baseline = load_baseline(baseline_path);
+        if (baseline.empty()) {
+            std::cerr << "No results in " << baseline_path << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::string saved;
+    bool regressed = false;
+    printf("%-14s %-9s %11s %-6s %11s %11s %14s%s\n", "workload", "phase", "size", "", "median ms", "min ms",
+           "throughput", baseline.empty() ? "" : "   vs baseline");
+    for (const Workload& workload : workloads(scale)) {
+        if (!filter.empty() && workload.name != filter) {
+            continue;
+        }
+        std::vector<Phase> phases;
+        try {
+            phases = bench(workload.generate(), reps);
+        } catch (const CompileError& error) {
+            std::cerr << workload.name << ": " << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        for (const Phase& phase : phases) {
+            std::string key = std::string(workload.name) + "." + phase.name;
+            double rate = static_cast<double>(phase.items) / phase.median_ms / 1e3;
+            printf("%-14s %-9s %11zu %-6s %11.3f %11.3f %8.2f M/s", workload.name, phase.name, phase.items,
+                   phase.unit, phase.median_ms, phase.min_ms, rate);
+            if (auto it = baseline.find(key); it != baseline.end()) {
+                double change = (phase.median_ms / it->second - 1) * 100;
+                printf("   %+7.1f%%", change);
+                if (change > threshold) {
+                    printf(" slower");
+                    regressed = true;
+                }
+            }
+            printf("\n");
+            saved += key + " ";
+            append_ms(saved, phase.median_ms);
+            saved += "\n";
+        }
+    }
+    if (!save.empty()) {
+        std::ofstream(save) << saved;
+    }
+    return regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
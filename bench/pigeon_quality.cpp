@@ -0,0 +1,284 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <sys/ptrace.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include "../src/stats.hpp"
+
+// Quality of the generated code. Compiles every <name>.pig in a corpus with the pigeon
+// driver at each optimization level, runs the executables and checks their exit status
+// and stdout against <name>.status and <name>.out (no .out means no output). A program
+// with a <name>.error instead has to be rejected at every level, with a diagnostic that
+// contains that file's first line. For every program and level it reports the static instruction count (from --stats=json), the
+// size of the executable, the number of system calls the program makes, counted by
+// tracing it with ptrace, and its median run time over --reps untraced runs.
+//
+//   pigeon_quality [--pigeon <path>] [--corpus <dir>] [--reps <n>] [--report <file>]
+//
+// The table goes to stdout and, with --report, the same results as JSON to file. Exits
+// non-zero if any program failed to compile or didn't behave as expected.
+
+struct Result {
+    std::string name;
+    int opt_level;
+    bool compiled = false;
+    int status = -1;
+    int expected_status = 0;
+    bool stdout_matches = false;
+    std::string expected_error {};  // empty if the program has to compile
+    std::string diagnostic {};
+    size_t instrs = 0;
+    size_t binary_bytes = 0;
+    long syscalls = -1;     // -1 if the program couldn't be traced
+    double run_ms = 0;
+
+    [[nodiscard]] bool ok() const {
+        if (!expected_error.empty()) {
+            return !compiled && diagnostic.find(expected_error) != std::string::npos;
+        }
+        return compiled && status == expected_status && stdout_matches;
+    }
+};
+
+static std::string read_file(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
+// Runs argv with stdout going to stdout_path (and stderr to stderr_path, if given) and
+// returns its wait status, or -1 if it couldn't be started.
+static int spawn(const std::vector<std::string>& args, const std::string& stdout_path, bool trace, long* syscalls,
+                 const std::string& stderr_path = "") {
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        int fd = open(stdout_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+            _exit(127);
+        }
+        close(fd);
+        if (!stderr_path.empty()) {
+            fd = open(stderr_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (fd < 0 || dup2(fd, STDERR_FILENO) < 0) {
+                _exit(127);
+            }
+            close(fd);
+        }
+        if (trace && ptrace(PTRACE_TRACEME, 0, nullptr, nullptr) != 0) {
+            _exit(126);
+        }
+        execv(argv[0], argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    if (!trace) {
+        waitpid(pid, &status, 0);
+        return status;
+    }
+    // stopped after execve, before the program's first instruction
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status)) {
+        return status;
+    }
+    ptrace(PTRACE_SETOPTIONS, pid, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+    long stops = 0;
+    int signal = 0;
+    while (true) {
+        ptrace(PTRACE_SYSCALL, pid, nullptr, signal);
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        signal = 0;
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            stops++;
+        } else {
+            signal = WSTOPSIG(status);
+        }
+    }
+    // a stop on entry and one on exit, except for the final exit that never returns
+    *syscalls = (stops + 1) / 2;
+    return status;
+}
+
+static int exit_status(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    return WIFSIGNALED(status) ? 128 + WTERMSIG(status) : -1;
+}
+
+// The number after "key": in a --stats=json document.
+static size_t json_count(const std::string& json, std::string_view key) {
+    size_t at = json.find("\"" + std::string(key) + "\": ");
+    return at == std::string::npos ? 0 : std::stoul(json.substr(at + key.size() + 4));
+}
+
+static Result measure(const std::string& pigeon, const std::filesystem::path& source, int opt_level,
+                      const std::filesystem::path& work, size_t reps) {
+    Result result {.name = source.stem(), .opt_level = opt_level};
+    std::filesystem::path expected_status = source.parent_path() / (result.name + ".status");
+    std::filesystem::path expected_out = source.parent_path() / (result.name + ".out");
+    std::filesystem::path expected_error = source.parent_path() / (result.name + ".error");
+    result.expected_status = std::atoi(read_file(expected_status).c_str());
+    result.expected_error = read_file(expected_error);
+    result.expected_error = result.expected_error.substr(0, result.expected_error.find('\n'));
+
+    std::string exe = work / (result.name + "-O" + std::to_string(opt_level));
+    std::string stats = exe + ".json";
+    int status = spawn({pigeon, "-O" + std::to_string(opt_level), "--stats=json", "-o", exe, source}, stats, false,
+                       nullptr, exe + ".stderr");
+    if (exit_status(status) != 0) {
+        result.diagnostic = read_file(exe + ".stderr");
+        return result;
+    }
+    result.compiled = true;
+    if (!result.expected_error.empty()) {
+        return result;
+    }
+    result.instrs = json_count(read_file(stats), "instrs");
+    result.binary_bytes = std::filesystem::file_size(exe);
+
+    std::string out = exe + ".stdout";
+    status = spawn({exe}, out, true, &result.syscalls);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 126) {
+        // tracing isn't allowed here; still check what the program does
+        result.syscalls = -1;
+        status = spawn({exe}, out, false, nullptr);
+    }
+    result.status = exit_status(status);
+    result.stdout_matches = read_file(out) == (std::filesystem::exists(expected_out) ? read_file(expected_out) : "");
+
+    std::vector<double> times;
+    for (size_t i = 0; i < reps; i++) {
+        double start = PassClock::now(CLOCK_MONOTONIC);
+        spawn({exe}, out, false, nullptr);
+        times.push_back(PassClock::now(CLOCK_MONOTONIC) - start);
+    }
+    std::sort(times.begin(), times.end());
+    result.run_ms = times.empty() ? 0 : times[times.size() / 2];
+    return result;
+}
+
+static std::string report(const std::string& pigeon, const std::vector<Result>& results) {
+    std::string out = "{\"pigeon\": ";
+    append_json_string(out, pigeon);
+    out += ", \"programs\": [";
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result& result = results[i];
+        out += i == 0 ? "{\"name\": " : ", {\"name\": ";
+        append_json_string(out, result.name);
+        out += ", \"opt_level\": " + std::to_string(result.opt_level);
+        out += std::string(", \"ok\": ") + (result.ok() ? "true" : "false");
+        out += std::string(", \"compiled\": ") + (result.compiled ? "true" : "false");
+        out += ", \"diagnostic\": ";
+        append_json_string(out, result.diagnostic);
+        out += ", \"status\": " + std::to_string(result.status);
+        out += ", \"expected_status\": " + std::to_string(result.expected_status);
+        out += std::string(", \"stdout_matches\": ") + (result.stdout_matches ? "true" : "false");
+        out += ", \"instrs\": " + std::to_string(result.instrs);
+        out += ", \"binary_bytes\": " + std::to_string(result.binary_bytes);
+        out += ", \"syscalls\": " + std::to_string(result.syscalls);
+        out += ", \"run_ms\": ";
+        append_ms(out, result.run_ms);
+        out += "}";
+    }
+    out += "]}\n";
+    return out;
+}
+
+static int usage() {
+    std::cerr << "pigeon_quality [--pigeon <path>] [--corpus <dir>] [--reps <n>] [--report <file>]" << std::endl;
+    return EXIT_FAILURE;
+}
+
+int main(int argc, char* argv[]) {
+    std::string pigeon = PIGEON_PATH;
+    std::string corpus = PIGEON_CORPUS;
+    std::string report_path;
+    size_t reps = 10;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "--pigeon" && i + 1 < argc) {
+            pigeon = argv[++i];
+        } else if (arg == "--corpus" && i + 1 < argc) {
+            corpus = argv[++i];
+        } else if (arg == "--reps" && i + 1 < argc) {
+            reps = std::stoul(argv[++i]);
+        } else if (arg == "--report" && i + 1 < argc) {
+            report_path = argv[++i];
+        } else {
+            return usage();
+        }
+    }
+    pigeon = std::filesystem::absolute(pigeon);
+
+    std::vector<std::filesystem::path> sources;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(corpus, error)) {
+        if (entry.path().extension() == ".pig") {
+            sources.push_back(entry.path());
+        }
+    }
+    if (sources.empty()) {
+        std::cerr << "No .pig files in " << corpus << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::sort(sources.begin(), sources.end());
+    char work_template[] = "/tmp/pigeon_quality.XXXXXX";
+    if (mkdtemp(work_template) == nullptr) {
+        std::cerr << "Unable to create a work directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::filesystem::path work = work_template;
+
+    std::vector<Result> results;
+    bool all_ok = true;
+    printf("%-16s %-4s %-6s %8s %8s %8s %10s\n", "program", "opt", "result", "instrs", "bytes", "syscalls", "run ms");
+    for (int opt_level : {0, 1}) {
+        size_t instrs = 0;
+        size_t bytes = 0;
+        long syscalls = 0;
+        double run_ms = 0;
+        for (const std::filesystem::path& source : sources) {
+            Result result = measure(pigeon, source, opt_level, work, reps);
+            const char* verdict = !result.expected_error.empty() ? (result.ok() ? "ok" : result.compiled ? "accept" : "diag")
+                : !result.compiled ? "error"
+                : result.status != result.expected_status ? "status"
+                : !result.stdout_matches ? "stdout" : "ok";
+            printf("%-16s -O%-2d %-6s %8zu %8zu %8ld %10.3f\n", result.name.c_str(), opt_level, verdict, result.instrs,
+                   result.binary_bytes, result.syscalls, result.run_ms);
+            all_ok &= result.ok();
+            instrs += result.instrs;
+            bytes += result.binary_bytes;
+            syscalls += std::max(result.syscalls, 0L);
+            run_ms += result.run_ms;
+            results.push_back(std::move(result));
+        }
+        printf("%-16s -O%-2d %-6s %8zu %8zu %8ld %10.3f\n", "total", opt_level, "", instrs, bytes, syscalls, run_ms);
+    }
+    std::filesystem::remove_all(work, error);
+    if (!report_path.empty()) {
+        std::ofstream(report_path) << report(pigeon, results);
+    }
+    return all_ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
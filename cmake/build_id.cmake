@@ -0,0 +1,19 @@
+# Writes OUTPUT, a header defining PIGEON_BUILD_ID as a hash of the compiler's sources
+# under SOURCE_DIR. The compile cache keys entries with it, so every change to the
+# sources, and nothing else, gives new keys. The header is only rewritten when the hash
+# changes, so an unchanged tree doesn't rebuild.
+file(GLOB sources RELATIVE "${SOURCE_DIR}" "${SOURCE_DIR}/src/*.hpp" "${SOURCE_DIR}/src/*.cpp")
+list(SORT sources)
+set(digests "")
+foreach (source IN LISTS sources)
+    file(SHA256 "${SOURCE_DIR}/${source}" digest)
+    string(APPEND digests "${source} ${digest}\n")
+endforeach ()
+string(SHA256 build_id "${digests}")
+set(header "#pragma once\n\n#define PIGEON_BUILD_ID \"${build_id}\"\n")
+if (EXISTS "${OUTPUT}")
+    file(READ "${OUTPUT}" old_header)
+endif ()
+if (NOT header STREQUAL old_header)
+    file(WRITE "${OUTPUT}" "${header}")
+endif ()
@@ -0,0 +1,280 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "./error.hpp"
+#include "pigeon_build_id.hpp"
+
+// 128-bit hash of data, for cache keys: two independent lanes that each fold in 8 bytes at
+// a time with a 64x64->128 bit multiply, in the style of wyhash. Not cryptographic, it only
+// has to make accidental collisions between inputs impossible in practice.
+struct Hash128 {
+    uint64_t lo;
+    uint64_t hi;
+};
+
+inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+    __uint128_t product = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+inline Hash128 hash_bytes(std::string_view data, Hash128 seed = {}) {
+    constexpr uint64_t k0 = 0xa0761d6478bd642f;
+    constexpr uint64_t k1 = 0xe7037ed1a0b428db;
+    constexpr uint64_t k2 = 0x8ebc6af09c88c6e3;
+    constexpr uint64_t k3 = 0x589965cc75374cc3;
+    uint64_t a = seed.lo ^ k0;
+    uint64_t b = seed.hi ^ k2;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, 8);
+        a = hash_mix(word ^ k1, a ^ k2);
+        b = hash_mix(word ^ k3, b ^ k0);
+    }
+    // the tail, zero padded; the length below tells it apart from real zero bytes
+    uint64_t word = 0;
+    if (i < data.size()) {
+        std::memcpy(&word, data.data() + i, data.size() - i);
+    }
+    a = hash_mix(word ^ k1, a ^ k2);
+    b = hash_mix(word ^ k3, b ^ k0);
+    return {.lo = hash_mix(a ^ data.size(), k3), .hi = hash_mix(b ^ data.size(), k1)};
+}
+
+// On-disk cache of compiler outputs, keyed by a hash of the source, the compiler's own sources
+// and the options, so an unchanged input skips the whole pipeline. An entry is one file per
+// output, <dir>/<key><suffix>: the executable, and .ir and .asm when they were asked for.
+// A hit hard-links the entry's files into place (copying them if the cache is on another
+// file system); that is safe because outputs are always replaced, never rewritten in place.
+//
+// Entries are written under a temporary name and renamed, so processes that share a
+// directory never see half an entry. Using an entry touches it, and finish() evicts the
+// least recently used entries until the directory is under the size limit, and adds this
+// process's hits and misses to the totals in <dir>/stats. It also deletes what failed or
+// crashed stores left behind: temporary files, and the .ir and .asm of entries whose
+// executable never arrived. Errors while storing are ignored, a cache that can't be
+// written just doesn't hit.
+class CompileCache {
+public:
+    inline CompileCache(std::string dir, uint64_t limit) : m_dir(std::move(dir)), m_limit(limit) {
+        std::error_code error;
+        std::filesystem::create_directories(m_dir, error);
+        if (!std::filesystem::is_directory(m_dir, error)) {
+            throw CompileError("Unable to use cache directory " + m_dir);
+        }
+    }
+
+    inline CompileCache(const CompileCache& other) = delete;
+
+    inline CompileCache& operator=(const CompileCache& other) = delete;
+
+    // Key for source compiled with options, which must spell out everything that changes
+    // the outputs. Changing the compiler's sources changes every key (PIGEON_BUILD_ID,
+    // generated by the build).
+    [[nodiscard]] static inline std::string key(std::string_view source, std::string_view options) {
+        Hash128 hash = hash_bytes(source, hash_bytes(options, hash_bytes(compiler_build)));
+        std::string name(32, '0');
+        for (int i = 0; i < 16; i++) {
+            name[15 - i] = "0123456789abcdef"[(hash.hi >> (i * 4)) & 15];
+            name[31 - i] = "0123456789abcdef"[(hash.lo >> (i * 4)) & 15];
+        }
+        return name;
+    }
+
+    // Puts the cached files for key at output + each suffix. Returns false if any of them
+    // isn't cached, or was evicted meanwhile; the outputs are then left for the compile to
+    // replace.
+    inline bool fetch(const std::string& key, const std::string& output, std::span<const std::string_view> suffixes) {
+        std::string entry = m_dir + "/" + key;
+        struct stat st {};
+        for (std::string_view suffix : suffixes) {
+            if (stat((entry + std::string(suffix)).c_str(), &st) != 0) {
+                m_misses++;
+                return false;
+            }
+        }
+        for (std::string_view suffix : suffixes) {
+            if (!place(entry + std::string(suffix), output + std::string(suffix))) {
+                m_misses++;
+                return false;
+            }
+        }
+        // mark it recently used; the executable's time stands for the whole entry
+        utimensat(AT_FDCWD, entry.c_str(), nullptr, 0);
+        m_hits++;
+        return true;
+    }
+
+    // Adds the files at output + each suffix to the cache under key. The executable goes
+    // last, so an entry is only complete once it is there.
+    inline void store(const std::string& key, const std::string& output, std::span<const std::string_view> suffixes) {
+        std::string entry = m_dir + "/" + key;
+        for (size_t i = suffixes.size(); i-- > 0;) {
+            std::string suffix(suffixes[i]);
+            std::string temp = m_dir + "/tmp-" + std::to_string(getpid()) + "-" + std::to_string(m_temp_id++);
+            if (!place(output + suffix, temp)) {
+                unlink(temp.c_str());
+                return;
+            }
+            if (rename(temp.c_str(), (entry + suffix).c_str()) != 0) {
+                unlink(temp.c_str());
+                return;
+            }
+        }
+    }
+
+    // Evicts down to the size limit and records this process's statistics. Call once, after
+    // the last compile.
+    inline void finish() {
+        std::lock_guard lock(m_mutex);
+        int fd = open((m_dir + "/stats").c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0) {
+            return;
+        }
+        flock(fd, LOCK_EX);
+        char text[64] {};
+        ssize_t n = pread(fd, text, sizeof(text) - 1, 0);
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        if (n > 0) {
+            std::sscanf(text, "%lu %lu", &hits, &misses);
+        }
+        m_total_hits = hits + m_hits.exchange(0);
+        m_total_misses = misses + m_misses.exchange(0);
+        std::string updated = std::to_string(m_total_hits) + " " + std::to_string(m_total_misses) + "\n";
+        if (pwrite(fd, updated.data(), updated.size(), 0) == static_cast<ssize_t>(updated.size())) {
+            ftruncate(fd, static_cast<off_t>(updated.size()));
+        }
+        evict();
+        flock(fd, LOCK_UN);
+        close(fd);
+    }
+
+    // "<hits> hits, <misses> misses, ..." over every process that used the directory, as
+    // of the last finish().
+    [[nodiscard]] inline std::string stats() const {
+        return std::to_string(m_total_hits) + " hits, " + std::to_string(m_total_misses) + " misses, "
+            + std::to_string(m_entries) + " entries, " + std::to_string(m_size) + " bytes (limit "
+            + std::to_string(m_limit) + ")";
+    }
+
+private:
+    // Hard-links from to to, replacing to, or copies if it can't be linked.
+    static inline bool place(const std::string& from, const std::string& to) {
+        unlink(to.c_str());
+        if (link(from.c_str(), to.c_str()) == 0) {
+            return true;
+        }
+        std::error_code error;
+        return std::filesystem::copy_file(from, to, std::filesystem::copy_options::overwrite_existing, error);
+    }
+
+    inline void evict() {
+        struct Entry {
+            std::string key;
+            timespec used;
+            uint64_t size;
+        };
+        struct File {
+            std::string name;
+            time_t modified;
+            uint64_t size;
+        };
+        std::vector<Entry> entries;
+        std::vector<File> files;
+        std::error_code error;
+        time_t stale = time(nullptr) - stale_seconds;
+        for (const auto& file : std::filesystem::directory_iterator(m_dir, error)) {
+            std::string name = file.path().filename();
+            struct stat st {};
+            if (lstat(file.path().c_str(), &st) != 0) {
+                continue;
+            }
+            if (name.starts_with("tmp-")) {
+                // left behind by a writer that died between writing and renaming
+                if (st.st_mtim.tv_sec < stale) {
+                    unlink(file.path().c_str());
+                }
+                continue;
+            }
+            if (!is_key(name)) {
+                continue;
+            }
+            if (name.size() == key_size) {
+                entries.push_back({.key = name, .used = st.st_mtim, .size = 0});
+            }
+            files.push_back({.name = name, .modified = st.st_mtim.tv_sec, .size = static_cast<uint64_t>(st.st_size)});
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.key < b.key;
+        });
+        m_size = 0;
+        for (const File& file : files) {
+            std::string_view prefix = std::string_view(file.name).substr(0, key_size);
+            auto it = std::lower_bound(entries.begin(), entries.end(), prefix, [](const Entry& entry, std::string_view key) {
+                return entry.key < key;
+            });
+            if (it != entries.end() && it->key == prefix) {
+                it->size += file.size;
+            } else if (file.modified < stale) {
+                // the executable was never stored, so nothing can use the rest of the entry
+                unlink((m_dir + "/" + file.name).c_str());
+                continue;
+            }
+            m_size += file.size;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec : a.used.tv_nsec < b.used.tv_nsec;
+        });
+        size_t evicted = 0;
+        for (; evicted < entries.size() && m_size > m_limit; evicted++) {
+            std::string entry = m_dir + "/" + entries[evicted].key;
+            for (const char* suffix : {".asm", ".ir", ""}) {
+                unlink((entry + suffix).c_str());
+            }
+            m_size -= entries[evicted].size;
+        }
+        m_entries = entries.size() - evicted;
+    }
+
+    // <32 hex digits>[.suffix]
+    static inline bool is_key(std::string_view name) {
+        if (name.size() < key_size || (name.size() > key_size && name[key_size] != '.')) {
+            return false;
+        }
+        return std::all_of(name.begin(), name.begin() + key_size, [](char c) {
+            return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+        });
+    }
+
+    static constexpr size_t key_size = 32;
+    // files without an entry this old aren't part of a store still in progress
+    static constexpr time_t stale_seconds = 600;
+    static constexpr std::string_view compiler_build = PIGEON_BUILD_ID;
+
+    std::string m_dir;
+    uint64_t m_limit;
+    std::atomic<uint64_t> m_hits = 0;
+    std::atomic<uint64_t> m_misses = 0;
+    std::atomic<uint64_t> m_temp_id = 0;
+    std::mutex m_mutex;
+    uint64_t m_total_hits = 0;
+    uint64_t m_total_misses = 0;
+    uint64_t m_entries = 0;
+    uint64_t m_size = 0;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./cache.hpp"
+#include "./error.hpp"
+#include "./source.hpp"
+#include "./stats.hpp"
+#include "./tokenization.hpp"
+#include "./parser.hpp"
+#include "./fold.hpp"
+#include "./dce.hpp"
+#include "./generation.hpp"
+#include "./ir.hpp"
+#include "./ir_codegen.hpp"
+#include "./encoder.hpp"
+#include "./elf.hpp"
+#include "./jit.hpp"
+#include "./nasm.hpp"
+#include "./output.hpp"
+
+struct CompileOptions {
+    int opt_level = 0;
+    bool emit_ir = false;   // also write the IR to <output>.ir
+    bool emit_asm = false;  // also write NASM source to <output>.asm
+};
+
+// Runs the whole pipeline for one input, in process: source -> instructions -> machine
+// code -> the executable <output>, or into memory to be executed right away (run). -O0
+// generates code from the IR, -O1 folds constants, removes dead code and generates from
+// the AST. A Compiler can be reused; the interner, AST and generator state are cleared
+// between compiles rather than reallocated. With a cache attached, compile() first looks
+// the source up there and skips everything after reading it on a hit.
+class Compiler {
+public:
+    inline Compiler()
+        : m_parser(std::vector<Token> {}, {}), m_generator(m_parser.ast(), m_interner),
+          m_ir_builder(m_parser.ast(), m_interner), m_ir_generator(m_ir_builder.program()) {
+    }
+
+    inline Compiler(const Compiler& other) = delete;
+
+    inline Compiler& operator=(const Compiler& other) = delete;
+
+    // Throws CompileError on any failure.
+    inline void compile(const std::string& input, const std::string& output, const CompileOptions& options = {}) {
+        PassClock clock(start_stats());
+        SourceFile source(input.c_str());
+        clock.lap("read");
+        std::optional<std::string> key;
+        std::string_view suffixes[3] = {""};
+        size_t outputs = 1;
+        if (m_cache != nullptr) {
+            std::string flags = "O" + std::to_string(options.opt_level);
+            if (options.emit_ir) {
+                flags += " emit-ir";
+                suffixes[outputs++] = ".ir";
+            }
+            if (options.emit_asm) {
+                flags += " emit-asm";
+                suffixes[outputs++] = ".asm";
+            }
+            key = CompileCache::key(source.view(), flags);
+            bool hit = m_cache->fetch(*key, output, {suffixes, outputs});
+            clock.lap("cache");
+            if (hit) {
+                m_stats.cached = true;
+                m_stats.source_bytes = source.view().size();
+                return;
+            }
+        }
+        const Assembly& assembly = generate(source.view(), output, options, Target::executable, clock);
+        m_elf_writer.write(output, m_encoder, assembly);
+        clock.lap("write");
+        if (key.has_value()) {
+            m_cache->store(*key, output, {suffixes, outputs});
+            clock.lap("cache");
+        }
+    }
+
+    // Compiles input and runs it in this process, returning its exit code. output only
+    // names the files --emit-ir and --emit-asm write. Throws CompileError if compiling
+    // fails.
+    inline int64_t run(const std::string& input, const std::string& output, const CompileOptions& options = {}) {
+        PassClock clock(start_stats());
+        SourceFile source(input.c_str());
+        clock.lap("read");
+        const Assembly& assembly = generate(source.view(), output, options, Target::jit, clock);
+        int64_t status = m_jit_runner.run(m_encoder, assembly);
+        clock.lap("execute");
+        return status;
+    }
+
+    // Compiles look their outputs up in cache, and store them there, until this is called
+    // again with nullptr. The cache must outlive its use; it can be shared between threads.
+    inline void use_cache(CompileCache* cache) {
+        m_cache = cache;
+    }
+
+    // While enabled, compile() and run() record the time spent in each pass, and the sizes
+    // of what the passes produced, in stats().
+    inline void measure(bool enabled) {
+        m_measure = enabled;
+    }
+
+    // Statistics of the last compile or run, when measuring.
+    [[nodiscard]] inline const CompileStats& stats() const {
+        return m_stats;
+    }
+
+    // AST of the last successful compile; not updated by cache hits.
+    [[nodiscard]] inline const Ast& ast() const {
+        return m_parser.ast();
+    }
+
+private:
+    inline CompileStats* start_stats() {
+        if (!m_measure) {
+            return nullptr;
+        }
+        m_stats.clear();
+        return &m_stats;
+    }
+
+    // Everything between reading the source and writing or running the code, which is
+    // left encoded in m_encoder. Tokenizing is interleaved with parsing, so the two are
+    // timed as one pass.
+    inline const Assembly& generate(std::string_view source, const std::string& output, const CompileOptions& options,
+                                    Target target, PassClock& clock) {
+        m_interner.clear();
+        Tokenizer tokenizer(source, m_interner);
+        m_parser.reset(tokenizer, source);
+        Ast& ast = m_parser.parse_prog();
+        clock.lap("parse");
+        if (options.opt_level > 0) {
+            ConstantFolder(ast, m_interner).run();
+            clock.lap("fold");
+            DeadCodeEliminator(ast, m_interner).run();
+            clock.lap("dce");
+        }
+        const IrProgram* ir = nullptr;
+        if (options.opt_level == 0 || options.emit_ir) {
+            ir = &m_ir_builder.build();
+            clock.lap("ir");
+            if (options.emit_ir) {
+                write_file(output + ".ir", ir->dump());
+                clock.lap("write-ir");
+            }
+        }
+        const Assembly& assembly = options.opt_level == 0 ? m_ir_generator.gen_prog(target) : m_generator.gen_prog(target);
+        clock.lap("codegen");
+        if (options.emit_asm) {
+            m_nasm_writer.write(output + ".asm", assembly);
+            clock.lap("write-asm");
+        }
+        m_encoder.encode(assembly.instrs);
+        clock.lap("encode");
+        if (m_measure) {
+            count(source, ir, assembly);
+        }
+        return assembly;
+    }
+
+    inline void count(std::string_view source, const IrProgram* ir, const Assembly& assembly) {
+        const Ast& ast = m_parser.ast();
+        m_stats.source_bytes = source.size();
+        m_stats.tokens = m_parser.token_count();
+        m_stats.ast_nodes = ast.nodes.size();
+        m_stats.ast_list_entries = ast.lists.size();
+        m_stats.ast_bytes = ast.nodes.size() * sizeof(Node) + ast.lists.size() * sizeof(NodeIndex);
+        m_stats.ast_reserved_bytes = ast.nodes.capacity() * sizeof(Node) + ast.lists.capacity() * sizeof(NodeIndex);
+        if (ir != nullptr) {
+            for (const IrBlock& block : ir->blocks) {
+                m_stats.ir_instrs += block.instrs.size();
+            }
+        }
+        m_stats.instrs = std::count_if(assembly.instrs.begin(), assembly.instrs.end(), [](const Instr& instr) {
+            return instr.op != Op::label && instr.op != Op::align;
+        });
+        m_stats.code_bytes = m_encoder.code().size();
+        m_stats.data_bytes = assembly.strings.size();
+    }
+
+    static inline void write_file(const std::string& path, const std::string& contents) {
+        iovec part = output_part(contents.data(), contents.size());
+        write_output(path, {&part, 1});
+    }
+
+    Interner m_interner;
+    Parser m_parser;
+    Generator m_generator;
+    IrBuilder m_ir_builder;
+    IrGenerator m_ir_generator;
+    X86Encoder m_encoder;
+    ElfWriter m_elf_writer;
+    JitRunner m_jit_runner;
+    NasmWriter m_nasm_writer;
+    CompileCache* m_cache = nullptr;
+    bool m_measure = false;
+    CompileStats m_stats;
+};
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "./error.hpp"
+#include "./parser.hpp"
+#include "./symbols.hpp"
+
+// Dead code elimination over the AST, run at -O1 after constant folding. Removes
+//  - statements after an `exit` in the same statement list,
+//  - assignments whose value is never read, and replaces a `let` initializer that is
+//    overwritten before it is read with 0,
+//  - `let`s whose variable is no longer referenced at all, so it takes no register or
+//    stack slot,
+//  - scopes, and `if`s, whose body ends up empty.
+// Liveness is computed per `let` in one backward walk. An `if` body may be skipped, so
+// whatever it kills is live again after it, and an `exit` kills everything. A `while` is
+// never removed, since it may not terminate; everything read anywhere in it counts as live
+// at the end of its body, which stands in for iterating to a fixed point.
+//
+// Expressions that can trap (division by anything but a constant other than 0 and -1) are
+// never removed. Names are resolved first, over the whole program, with the same errors
+// the generators report, so code removed here still gets checked; code that folding
+// removed was checked by ConstantFolder.
+class DeadCodeEliminator {
+public:
+    inline DeadCodeEliminator(Ast& ast, const Interner& interner) : m_ast(ast), m_interner(interner) {
+    }
+
+    inline void run() {
+        m_binding.assign(m_ast.nodes.size(), 0);
+        m_refs.assign(m_ast.nodes.size(), 0);
+        m_live.assign(m_ast.nodes.size(), 0);
+        m_undo.clear();
+        m_clock = 0;
+        m_floor = 0;
+        m_vars.clear();
+        m_stack.clear();
+        resolve_stmts(m_ast.root);
+        sweep_stmts(m_ast.root);
+    }
+
+private:
+    // Pass 1: bind every identifier and assignment to its let, and truncate statement lists
+    // after a statement that always exits. Returns whether the list always exits.
+    inline bool resolve_stmts(NodeIndex index) {
+        m_vars.begin_scope();
+        Node& list = m_ast.nodes[index];
+        auto children = m_ast.children(list);
+        bool exits = false;
+        for (uint32_t i = 0; i < children.size(); i++) {
+            if (exits = resolve_stmt(children[i]); exits) {
+                // still resolved, for its errors
+                for (NodeIndex unreachable : children.subspan(i + 1)) {
+                    resolve_stmt(unreachable);
+                }
+                list.rhs = i + 1;
+                break;
+            }
+        }
+        m_vars.end_scope();
+        return exits;
+    }
+
+    inline bool resolve_stmt(NodeIndex index) {
+        const Node& stmt = m_ast[index];
+        switch (stmt.kind) {
+            case NodeKind::exit:
+                resolve_expr(stmt.lhs);
+                return true;
+            case NodeKind::let:
+                resolve_expr(stmt.rhs);
+                if (!m_vars.declare(stmt.lhs, index)) {
+                    throw CompileError("Identifier already used.");
+                }
+                return false;
+            case NodeKind::assign: {
+                const NodeIndex* let = m_vars.lookup(stmt.lhs);
+                if (let == nullptr) {
+                    throw CompileError("Identifier not found.");
+                }
+                resolve_expr(stmt.rhs);
+                m_binding[index] = *let;
+                return false;
+            }
+            case NodeKind::print:
+                for (NodeIndex expr : m_ast.children(stmt)) {
+                    resolve_expr(expr);
+                }
+                return false;
+            case NodeKind::scope:
+                return resolve_stmts(index);
+            case NodeKind::if_:
+            case NodeKind::while_:
+                resolve_expr(stmt.lhs);
+                resolve_stmts(stmt.rhs);
+                return false;
+            default:
+                return false;
+        }
+    }
+
+    inline void resolve_expr(NodeIndex index) {
+        m_ast.visit_expr(index, m_stack, [&](NodeIndex node) {
+            const Node& expr = m_ast[node];
+            if (expr.kind != NodeKind::ident) {
+                return;
+            }
+            const NodeIndex* let = m_vars.lookup(expr.lhs);
+            if (let == nullptr) {
+                throw CompileError("Undeclared identifier: " + std::string(m_interner.name(expr.lhs)));
+            }
+            m_binding[node] = *let;
+        });
+    }
+
+    // Pass 2: walk a statement list backwards, removing dead statements in place. Returns
+    // whether anything is left.
+    inline bool sweep_stmts(NodeIndex index) {
+        Node& list = m_ast.nodes[index];
+        // kept statements are collected at the end of the list, then moved to the front
+        uint32_t first = list.rhs;
+        for (uint32_t i = list.rhs; i-- > 0;) {
+            NodeIndex child = m_ast.lists[list.lhs + i];
+            if (sweep_stmt(child)) {
+                m_ast.lists[list.lhs + --first] = child;
+            }
+        }
+        if (first > 0) {
+            std::copy(m_ast.lists.begin() + list.lhs + first, m_ast.lists.begin() + list.lhs + list.rhs,
+                      m_ast.lists.begin() + list.lhs);
+        }
+        list.rhs -= first;
+        return list.rhs > 0;
+    }
+
+    // Returns false if the statement should be removed.
+    inline bool sweep_stmt(NodeIndex index) {
+        const Node& stmt = m_ast[index];
+        switch (stmt.kind) {
+            case NodeKind::exit:
+                // nothing is read after this
+                m_floor = m_clock;
+                use_expr(stmt.lhs);
+                return true;
+            case NodeKind::let:
+                if (m_refs[index] == 0 && !m_ast.can_trap(stmt.rhs, m_stack)) {
+                    return false;
+                }
+                if (!is_live(index) && !m_ast.can_trap(stmt.rhs, m_stack)) {
+                    set_zero(stmt.rhs);
+                }
+                use_expr(stmt.rhs);
+                return true;
+            case NodeKind::assign: {
+                NodeIndex let = m_binding[index];
+                if (!is_live(let) && !m_ast.can_trap(stmt.rhs, m_stack)) {
+                    return false;
+                }
+                kill(let);
+                m_refs[let]++;
+                use_expr(stmt.rhs);
+                return true;
+            }
+            case NodeKind::print:
+                for (NodeIndex expr : m_ast.children(stmt)) {
+                    use_expr(expr);
+                }
+                return true;
+            case NodeKind::scope:
+                return sweep_stmts(index);
+            case NodeKind::if_: {
+                bool body = sweep_body(stmt.rhs);
+                if (!body && !m_ast.can_trap(stmt.lhs, m_stack)) {
+                    return false;
+                }
+                use_expr(stmt.lhs);
+                return true;
+            }
+            case NodeKind::while_:
+                // the condition, then the next iteration, follow the body
+                keep_live(stmt.lhs);
+                keep_live_stmts(stmt.rhs);
+                sweep_body(stmt.rhs);
+                use_expr(stmt.lhs);
+                return true;
+            default:
+                return true;
+        }
+    }
+
+    // Sweeps a body that may not run at all: what it kills stays live. Returns whether
+    // anything is left.
+    inline bool sweep_body(NodeIndex index) {
+        uint32_t floor = m_floor;
+        size_t undo = m_undo.size();
+        bool body = sweep_stmts(index);
+        m_floor = floor;
+        for (size_t i = m_undo.size(); i-- > undo;) {
+            m_live[m_undo[i].let] = std::max(m_live[m_undo[i].let], m_undo[i].live);
+        }
+        m_undo.resize(undo);
+        return body;
+    }
+
+    // Marks every let read in a statement list live, without counting the reads.
+    inline void keep_live_stmts(NodeIndex index) {
+        for (NodeIndex child : m_ast.children(m_ast[index])) {
+            const Node& stmt = m_ast[child];
+            switch (stmt.kind) {
+                case NodeKind::exit:
+                    keep_live(stmt.lhs);
+                    break;
+                case NodeKind::let:
+                case NodeKind::assign:
+                    keep_live(stmt.rhs);
+                    break;
+                case NodeKind::print:
+                    for (NodeIndex expr : m_ast.children(stmt)) {
+                        keep_live(expr);
+                    }
+                    break;
+                case NodeKind::scope:
+                    keep_live_stmts(child);
+                    break;
+                case NodeKind::if_:
+                case NodeKind::while_:
+                    keep_live(stmt.lhs);
+                    keep_live_stmts(stmt.rhs);
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    inline void keep_live(NodeIndex index) {
+        m_ast.visit_expr(index, m_stack, [&](NodeIndex node) {
+            if (m_ast[node].kind == NodeKind::ident) {
+                m_live[m_binding[node]] = ++m_clock;
+            }
+        });
+    }
+
+    // A let is live if it was used after the last exit (walking backwards) and not killed.
+    inline bool is_live(NodeIndex let) const {
+        return m_live[let] > m_floor;
+    }
+
+    inline void kill(NodeIndex let) {
+        m_undo.push_back({.let = let, .live = m_live[let]});
+        m_live[let] = 0;
+    }
+
+    inline void use_expr(NodeIndex index) {
+        m_ast.visit_expr(index, m_stack, [&](NodeIndex node) {
+            if (m_ast[node].kind == NodeKind::ident) {
+                NodeIndex let = m_binding[node];
+                m_live[let] = ++m_clock;
+                m_refs[let]++;
+            }
+        });
+    }
+
+    inline void set_zero(NodeIndex index) {
+        m_ast.nodes[index] = {.kind = NodeKind::int_lit};
+    }
+
+    struct Undo {
+        NodeIndex let;
+        uint32_t live;
+    };
+
+    Ast& m_ast;
+    const Interner& m_interner;
+    ScopedSymbolTable<NodeIndex> m_vars;
+    std::vector<NodeIndex> m_binding;   // per ident and assign node: its let
+    std::vector<uint32_t> m_refs;       // per let: reads and assignments kept so far
+    // Liveness per let, as the clock value of its last use; everything at or below
+    // m_floor is dead. Raising the floor kills every let at once.
+    std::vector<uint32_t> m_live;
+    std::vector<Undo> m_undo;           // kills inside the current if bodies
+    std::vector<NodeIndex> m_stack;     // for walking expressions
+    uint32_t m_clock = 0;
+    uint32_t m_floor = 0;
+};
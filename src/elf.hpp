@@ -0,0 +1,93 @@
+#pragma once
+
+#include <cstring>
+#include <elf.h>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include <vector>
+#include "./encoder.hpp"
+#include "./error.hpp"
+#include "./output.hpp"
+#include "./runtime.hpp"
+#include "./x86.hpp"
+
+// Writes encoded code as a static x86-64 Linux executable, without an assembler or linker.
+// The file is the ELF header, the program headers, the code and the string table, all in
+// one read+execute segment loaded at elf_base. Programs that print get a second,
+// read+write segment for the output buffer that takes no space in the file. There are no
+// section headers; the kernel doesn't need them.
+inline constexpr uint64_t elf_base = 0x400000;
+inline constexpr uint64_t elf_page = 0x1000;
+
+class ElfWriter {
+public:
+    // Writes the executable to path, filling in the encoder's references to data.
+    inline void write(const std::string& path, X86Encoder& encoder, const Assembly& assembly) {
+        size_t segment_count = assembly.prints ? 2 : 1;
+        size_t headers_size = sizeof(Elf64_Ehdr) + segment_count * sizeof(Elf64_Phdr);
+        size_t code_offset = align(headers_size, 16);
+        size_t strings_offset = code_offset + encoder.code().size();
+        size_t file_size = strings_offset + assembly.strings.size();
+        uint64_t bss = align(elf_base + file_size, elf_page);
+
+        // the headers, padded up to the code
+        m_headers.assign(code_offset, 0);
+        Elf64_Ehdr header {};
+        std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = ELFCLASS64;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = ET_EXEC;
+        header.e_machine = EM_X86_64;
+        header.e_version = EV_CURRENT;
+        header.e_entry = elf_base + code_offset;
+        header.e_phoff = sizeof(Elf64_Ehdr);
+        header.e_ehsize = sizeof(Elf64_Ehdr);
+        header.e_phentsize = sizeof(Elf64_Phdr);
+        header.e_phnum = segment_count;
+        std::memcpy(m_headers.data(), &header, sizeof(header));
+
+        Elf64_Phdr segments[2] {};
+        segments[0] = {.p_type = PT_LOAD, .p_flags = PF_R | PF_X, .p_offset = 0, .p_vaddr = elf_base,
+                       .p_paddr = elf_base, .p_filesz = file_size, .p_memsz = file_size, .p_align = elf_page};
+        segments[1] = {.p_type = PT_LOAD, .p_flags = PF_R | PF_W, .p_offset = 0, .p_vaddr = bss, .p_paddr = bss,
+                       .p_filesz = 0, .p_memsz = print_buffer_size + 8, .p_align = elf_page};
+        std::memcpy(m_headers.data() + sizeof(Elf64_Ehdr), segments, segment_count * sizeof(Elf64_Phdr));
+
+        uint64_t strings = elf_base + strings_offset;
+        encoder.patch_data(elf_base + code_offset, [&](std::string_view sym) {
+            return data_address(sym, strings, bss);
+        });
+
+        const std::vector<uint8_t>& code = encoder.code();
+        iovec parts[] = {
+            output_part(m_headers.data(), m_headers.size()),
+            output_part(code.data(), code.size()),
+            output_part(assembly.strings.data(), assembly.strings.size()),
+        };
+        write_output(path, parts, 0777);
+    }
+
+private:
+    static inline uint64_t align(uint64_t value, uint64_t alignment) {
+        return (value + alignment - 1) & ~(alignment - 1);
+    }
+
+    // Addresses of the data symbols the runtime refers to.
+    static inline uint64_t data_address(std::string_view sym, uint64_t strings, uint64_t bss) {
+        if (sym == "strings") {
+            return strings;
+        }
+        if (sym == "outbuf") {
+            return bss;
+        }
+        if (sym == "outpos") {
+            return bss + print_buffer_size;
+        }
+        throw CompileError("Internal error: undefined symbol " + std::string(sym));
+    }
+
+    std::vector<uint8_t> m_headers;
+};
@@ -0,0 +1,475 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "./error.hpp"
+#include "./x86.hpp"
+
+// A 32-bit field in the code that refers to a data symbol, filled in once the data has an
+// address: either the absolute address or, for RIP-relative operands, the distance from
+// next_ip, the end of the instruction.
+struct DataFixup {
+    size_t pos;
+    std::string_view sym;
+    int64_t addend;
+    bool relative;
+    size_t next_ip = 0;
+};
+
+// Encodes an instruction list into x86-64 machine code. Jumps to code labels are resolved
+// here, picking the 2-byte form whenever the target is close enough: every jump starts out
+// short and the ones that turn out not to fit are widened, repeating until nothing grows.
+// References to data symbols are filled in by patch_data once whoever lays out the data
+// (elf.hpp) knows where it goes.
+//
+// Only the instruction forms the generators produce are supported; anything else is an
+// internal error.
+class X86Encoder {
+public:
+    inline void encode(const std::vector<Instr>& instrs) {
+        m_near.assign(instrs.size(), false);
+        while (true) {
+            m_code.clear();
+            m_fixups.clear();
+            m_branches.clear();
+            m_labels.clear();
+            m_named_labels.clear();
+            for (size_t i = 0; i < instrs.size(); i++) {
+                m_instr = i;
+                encode_instr(instrs[i]);
+            }
+            if (!resolve_branches()) {
+                return;
+            }
+        }
+    }
+
+    [[nodiscard]] inline const std::vector<uint8_t>& code() const {
+        return m_code;
+    }
+
+    // Offset of a named label in the code.
+    [[nodiscard]] inline size_t symbol_offset(std::string_view sym) const {
+        return label_address(sym_operand(sym));
+    }
+
+    // Fills in the references to data symbols once the code is placed at code_address;
+    // address(sym) gives the address of a symbol. Absolute references are sign-extended
+    // 32-bit fields, so the data has to be in the low 2 GiB.
+    template <typename Resolve>
+    inline void patch_data(uint64_t code_address, Resolve address) {
+        for (const DataFixup& fixup : m_fixups) {
+            uint64_t target = address(fixup.sym) + fixup.addend;
+            if (!fixup.relative && target > INT32_MAX) {
+                throw CompileError("Internal error: " + std::string(fixup.sym) + " is out of reach");
+            }
+            patch32(fixup.pos, fixup.relative ? static_cast<int64_t>(target - (code_address + fixup.next_ip))
+                                              : static_cast<int64_t>(target));
+        }
+    }
+
+private:
+    struct Branch {
+        size_t pos;         // of the displacement
+        size_t next_ip;
+        Operand target;
+        size_t instr;
+        bool near;          // 32-bit displacement
+    };
+
+    [[noreturn]] static inline void unsupported(const Instr& instr) {
+        std::string text;
+        append_instr(text, instr);
+        throw CompileError("Internal error: no encoding for" + text.substr(text.find(' ')));
+    }
+
+    static inline uint8_t num(Reg reg) {
+        return static_cast<uint8_t>(reg);
+    }
+
+    static inline bool fits_imm8(int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    inline void byte(uint8_t value) {
+        m_code.push_back(value);
+    }
+
+    inline void bytes(int64_t value, size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            m_code.push_back(static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i)));
+        }
+    }
+
+    inline void patch32(size_t pos, int64_t value) {
+        for (size_t i = 0; i < 4; i++) {
+            m_code[pos + i] = static_cast<uint8_t>(static_cast<uint64_t>(value) >> (8 * i));
+        }
+    }
+
+    // Emits [REX] opcode ModRM [SIB] [disp] with `reg` in the ModRM reg field (a register
+    // or an opcode extension) and rm as the register or memory operand. wide sets REX.W,
+    // byte_regs says the registers are 8-bit (spl..dil need a REX prefix to be addressed),
+    // and imm_size is the size of the immediate that follows, which RIP-relative
+    // displacements are measured past.
+    inline void modrm_instr(bool wide, std::initializer_list<uint8_t> opcode, uint8_t reg, const Operand& rm,
+                            size_t imm_size = 0, bool byte_regs = false) {
+        uint8_t rex = (wide ? 0x08 : 0) | (reg >= 8 ? 0x04 : 0);
+        if (rm.kind == Operand::Kind::reg) {
+            rex |= num(rm.reg) >= 8 ? 0x01 : 0;
+            if (byte_regs && num(rm.reg) >= 4 && num(rm.reg) < 8) {
+                rex |= 0x40;
+            }
+        } else {
+            rex |= rm.scale != 0 && num(rm.index) >= 8 ? 0x02 : 0;
+            rex |= rm.sym.empty() && num(rm.reg) >= 8 ? 0x01 : 0;
+        }
+        if (byte_regs && reg >= 4 && reg < 8) {
+            rex |= 0x40;
+        }
+        if (rex != 0) {
+            byte(0x40 | rex);
+        }
+        for (uint8_t op : opcode) {
+            byte(op);
+        }
+        uint8_t reg_bits = (reg & 7) << 3;
+        if (rm.kind == Operand::Kind::reg) {
+            byte(0xc0 | reg_bits | (num(rm.reg) & 7));
+            return;
+        }
+        uint8_t scale_bits = rm.scale == 8 ? 3 : rm.scale == 4 ? 2 : rm.scale == 2 ? 1 : 0;
+        if (!rm.sym.empty()) {
+            if (rm.scale == 0) {
+                // [rip + disp32]
+                byte(reg_bits | 5);
+                m_fixups.push_back({.pos = m_code.size(), .sym = rm.sym, .addend = rm.value, .relative = true,
+                                    .next_ip = m_code.size() + 4 + imm_size});
+            } else {
+                // [index*scale + disp32], no base
+                byte(reg_bits | 4);
+                byte(scale_bits << 6 | (num(rm.index) & 7) << 3 | 5);
+                m_fixups.push_back({.pos = m_code.size(), .sym = rm.sym, .addend = rm.value, .relative = false});
+            }
+            bytes(0, 4);
+            return;
+        }
+        uint8_t base = num(rm.reg) & 7;
+        uint8_t mod = rm.value == 0 && base != 5 ? 0 : fits_imm8(rm.value) ? 1 : 2;
+        if (rm.scale != 0 || base == 4) {
+            // a SIB byte, with index 4 meaning none
+            byte(mod << 6 | reg_bits | 4);
+            byte(scale_bits << 6 | (rm.scale != 0 ? num(rm.index) & 7 : 4) << 3 | base);
+        } else {
+            byte(mod << 6 | reg_bits | base);
+        }
+        bytes(rm.value, mod == 0 ? 0 : mod == 1 ? 1 : 4);
+    }
+
+    // Short-form opcode with the register in its low 3 bits (push, pop, mov r, imm).
+    inline void reg_in_opcode(bool wide, uint8_t opcode, Reg reg) {
+        uint8_t rex = (wide ? 0x08 : 0) | (num(reg) >= 8 ? 0x01 : 0);
+        if (rex != 0) {
+            byte(0x40 | rex);
+        }
+        byte(opcode | (num(reg) & 7));
+    }
+
+    // The recommended multi-byte no-ops (Intel SDM, NOP), at most 9 bytes each, so padding
+    // decodes as few instructions.
+    inline void nops(size_t count) {
+        constexpr uint8_t forms[9][9] = {
+            {0x90},
+            {0x66, 0x90},
+            {0x0f, 0x1f, 0x00},
+            {0x0f, 0x1f, 0x40, 0x00},
+            {0x0f, 0x1f, 0x44, 0x00, 0x00},
+            {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+            {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+            {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+            {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+        };
+        while (count > 0) {
+            size_t size = std::min<size_t>(count, 9);
+            m_code.insert(m_code.end(), forms[size - 1], forms[size - 1] + size);
+            count -= size;
+        }
+    }
+
+    inline void branch(const Operand& target, std::initializer_list<uint8_t> short_form,
+                       std::initializer_list<uint8_t> near_form, bool always_near = false) {
+        bool near = always_near || m_near[m_instr];
+        for (uint8_t op : near ? near_form : short_form) {
+            byte(op);
+        }
+        m_branches.push_back({.pos = m_code.size(), .next_ip = m_code.size() + (near ? 4 : 1), .target = target,
+                              .instr = m_instr, .near = near});
+        bytes(0, near ? 4 : 1);
+    }
+
+    // Opcode of a setcc or jcc: the condition codes of e, ne, l, ge, le, g are added to base.
+    static inline uint8_t condition_code(Op op, Op first, uint8_t base) {
+        constexpr uint8_t codes[] = {0x4, 0x5, 0xc, 0xd, 0xe, 0xf};
+        return base + codes[static_cast<uint8_t>(op) - static_cast<uint8_t>(first)];
+    }
+
+    // add, sub, xor, cmp: opcode for `op r/m, r`, and the extension for `op r/m, imm`.
+    inline void alu(const Instr& instr, uint8_t opcode, uint8_t extension) {
+        const Operand& a = instr.a;
+        const Operand& b = instr.b;
+        bool wide = a.size == 8;
+        if (b.kind == Operand::Kind::reg && a.kind != Operand::Kind::imm) {
+            modrm_instr(wide, {opcode}, num(b.reg), a);
+        } else if (a.kind == Operand::Kind::reg && b.kind == Operand::Kind::mem) {
+            modrm_instr(wide, {static_cast<uint8_t>(opcode + 2)}, num(a.reg), b);
+        } else if (b.kind == Operand::Kind::imm && fits_imm8(b.value)) {
+            modrm_instr(wide, {0x83}, extension, a, 1);
+            bytes(b.value, 1);
+        } else if (b.kind == Operand::Kind::imm && fits_imm32(b.value)) {
+            modrm_instr(wide, {0x81}, extension, a, 4);
+            bytes(b.value, 4);
+        } else {
+            unsupported(instr);
+        }
+    }
+
+    inline void encode_instr(const Instr& instr) {
+        const Operand& a = instr.a;
+        const Operand& b = instr.b;
+        switch (instr.op) {
+            case Op::label:
+                if (a.kind == Operand::Kind::sym) {
+                    m_named_labels[a.sym] = m_code.size();
+                } else {
+                    if (m_labels.size() <= static_cast<size_t>(a.value)) {
+                        m_labels.resize(a.value + 1, SIZE_MAX);
+                    }
+                    m_labels[a.value] = m_code.size();
+                }
+                return;
+            case Op::align:
+                nops((a.value - m_code.size() % a.value) % a.value);
+                return;
+            case Op::mov:
+                if (a.kind == Operand::Kind::reg && b.kind == Operand::Kind::imm) {
+                    if (b.value >= 0 && b.value <= UINT32_MAX) {
+                        // writing the low half zeroes the rest
+                        reg_in_opcode(false, 0xb8, a.reg);
+                        bytes(b.value, 4);
+                    } else if (fits_imm32(b.value)) {
+                        modrm_instr(true, {0xc7}, 0, a, 4);
+                        bytes(b.value, 4);
+                    } else {
+                        reg_in_opcode(true, 0xb8, a.reg);
+                        bytes(b.value, 8);
+                    }
+                } else if (a.kind == Operand::Kind::reg && b.kind == Operand::Kind::sym) {
+                    // data lives in the low 2 GiB
+                    reg_in_opcode(false, 0xb8, a.reg);
+                    m_fixups.push_back({.pos = m_code.size(), .sym = b.sym, .addend = b.value, .relative = false});
+                    bytes(0, 4);
+                } else if (b.kind == Operand::Kind::reg && a.kind != Operand::Kind::imm) {
+                    modrm_instr(a.size == 8, {static_cast<uint8_t>(a.size == 1 ? 0x88 : 0x89)}, num(b.reg), a, 0, a.size == 1);
+                } else if (a.kind == Operand::Kind::reg && b.kind == Operand::Kind::mem) {
+                    modrm_instr(a.size == 8, {static_cast<uint8_t>(a.size == 1 ? 0x8a : 0x8b)}, num(a.reg), b, 0, a.size == 1);
+                } else if (a.kind == Operand::Kind::mem && b.kind == Operand::Kind::imm && a.size == 1) {
+                    modrm_instr(false, {0xc6}, 0, a, 1);
+                    bytes(b.value, 1);
+                } else if (a.kind == Operand::Kind::mem && b.kind == Operand::Kind::imm && fits_imm32(b.value)) {
+                    modrm_instr(a.size == 8, {0xc7}, 0, a, 4);
+                    bytes(b.value, 4);
+                } else {
+                    unsupported(instr);
+                }
+                return;
+            case Op::movzx:
+                if (a.kind != Operand::Kind::reg || b.size != 1) {
+                    unsupported(instr);
+                }
+                modrm_instr(true, {0x0f, 0xb6}, num(a.reg), b, 0, true);
+                return;
+            case Op::push:
+                if (a.kind == Operand::Kind::reg) {
+                    reg_in_opcode(false, 0x50, a.reg);
+                } else if (a.kind == Operand::Kind::imm && fits_imm8(a.value)) {
+                    byte(0x6a);
+                    bytes(a.value, 1);
+                } else if (a.kind == Operand::Kind::imm && fits_imm32(a.value)) {
+                    byte(0x68);
+                    bytes(a.value, 4);
+                } else if (a.kind == Operand::Kind::mem) {
+                    modrm_instr(false, {0xff}, 6, a);
+                } else {
+                    unsupported(instr);
+                }
+                return;
+            case Op::pop:
+                if (a.kind == Operand::Kind::reg) {
+                    reg_in_opcode(false, 0x58, a.reg);
+                } else if (a.kind == Operand::Kind::mem) {
+                    modrm_instr(false, {0x8f}, 0, a);
+                } else {
+                    unsupported(instr);
+                }
+                return;
+            case Op::lea:
+                if (a.kind != Operand::Kind::reg || b.kind != Operand::Kind::mem) {
+                    unsupported(instr);
+                }
+                modrm_instr(true, {0x8d}, num(a.reg), b);
+                return;
+            case Op::add:
+                alu(instr, 0x01, 0);
+                return;
+            case Op::sub:
+                alu(instr, 0x29, 5);
+                return;
+            case Op::xor_:
+                alu(instr, 0x31, 6);
+                return;
+            case Op::cmp:
+                alu(instr, 0x39, 7);
+                return;
+            case Op::test:
+                if (b.kind == Operand::Kind::reg) {
+                    modrm_instr(a.size == 8, {0x85}, num(b.reg), a);
+                } else if (b.kind == Operand::Kind::imm && fits_imm32(b.value)) {
+                    modrm_instr(a.size == 8, {0xf7}, 0, a, 4);
+                    bytes(b.value, 4);
+                } else {
+                    unsupported(instr);
+                }
+                return;
+            case Op::neg:
+                modrm_instr(true, {0xf7}, 3, a);
+                return;
+            case Op::mul:
+                modrm_instr(true, {0xf7}, 4, a);
+                return;
+            case Op::div:
+                modrm_instr(true, {0xf7}, 6, a);
+                return;
+            case Op::idiv:
+                modrm_instr(true, {0xf7}, 7, a);
+                return;
+            case Op::imul:
+                if (b.kind == Operand::Kind::none) {
+                    modrm_instr(true, {0xf7}, 5, a);
+                } else if (a.kind != Operand::Kind::reg) {
+                    unsupported(instr);
+                } else if (instr.c.kind == Operand::Kind::none) {
+                    modrm_instr(true, {0x0f, 0xaf}, num(a.reg), b);
+                } else if (fits_imm8(instr.c.value)) {
+                    modrm_instr(true, {0x6b}, num(a.reg), b, 1);
+                    bytes(instr.c.value, 1);
+                } else if (fits_imm32(instr.c.value)) {
+                    modrm_instr(true, {0x69}, num(a.reg), b, 4);
+                    bytes(instr.c.value, 4);
+                } else {
+                    unsupported(instr);
+                }
+                return;
+            case Op::shl:
+            case Op::sar:
+            case Op::shr: {
+                uint8_t extension = instr.op == Op::shl ? 4 : instr.op == Op::shr ? 5 : 7;
+                if (b.kind != Operand::Kind::imm) {
+                    unsupported(instr);
+                }
+                if (b.value == 1) {
+                    modrm_instr(true, {0xd1}, extension, a);
+                } else {
+                    modrm_instr(true, {0xc1}, extension, a, 1);
+                    bytes(b.value, 1);
+                }
+                return;
+            }
+            case Op::cqo:
+                byte(0x48);
+                byte(0x99);
+                return;
+            case Op::sete:
+            case Op::setne:
+            case Op::setl:
+            case Op::setge:
+            case Op::setle:
+            case Op::setg:
+                modrm_instr(false, {0x0f, condition_code(instr.op, Op::sete, 0x90)}, 0, a, 0, true);
+                return;
+            case Op::jz:
+            case Op::jnz:
+            case Op::jl:
+            case Op::jge:
+            case Op::jle:
+            case Op::jg:
+                branch(a, {condition_code(instr.op, Op::jz, 0x70)}, {0x0f, condition_code(instr.op, Op::jz, 0x80)});
+                return;
+            case Op::jmp:
+                if (a.kind == Operand::Kind::reg) {
+                    modrm_instr(false, {0xff}, 4, a);
+                    return;
+                }
+                branch(a, {0xeb}, {0xe9});
+                return;
+            case Op::call:
+                branch(a, {}, {0xe8}, true);
+                return;
+            case Op::ret:
+                byte(0xc3);
+                return;
+            case Op::syscall:
+                byte(0x0f);
+                byte(0x05);
+                return;
+            case Op::rep_movsb:
+                byte(0xf3);
+                byte(0xa4);
+                return;
+        }
+        unsupported(instr);
+    }
+
+    inline size_t label_address(const Operand& target) const {
+        if (target.kind == Operand::Kind::sym) {
+            auto found = m_named_labels.find(target.sym);
+            if (found != m_named_labels.end()) {
+                return found->second;
+            }
+        } else if (static_cast<size_t>(target.value) < m_labels.size() && m_labels[target.value] != SIZE_MAX) {
+            return m_labels[target.value];
+        }
+        std::string name;
+        append_operand(name, target);
+        throw CompileError("Internal error: undefined label " + name);
+    }
+
+    // Fills in the branch displacements. Returns whether a short branch had to be widened,
+    // in which case the code has to be encoded again.
+    inline bool resolve_branches() {
+        bool widened = false;
+        for (const Branch& branch : m_branches) {
+            int64_t disp = static_cast<int64_t>(label_address(branch.target)) - static_cast<int64_t>(branch.next_ip);
+            if (branch.near) {
+                patch32(branch.pos, disp);
+            } else if (fits_imm8(disp)) {
+                m_code[branch.pos] = static_cast<uint8_t>(disp);
+            } else {
+                m_near[branch.instr] = true;
+                widened = true;
+            }
+        }
+        return widened;
+    }
+
+    std::vector<uint8_t> m_code;
+    std::vector<DataFixup> m_fixups;
+    std::vector<Branch> m_branches;
+    std::vector<size_t> m_labels;
+    std::unordered_map<std::string_view, size_t> m_named_labels;
+    std::vector<bool> m_near;   // per instruction: this jump needs a 32-bit displacement
+    size_t m_instr = 0;
+};
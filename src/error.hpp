@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+
+// Thrown for any error in the user's program (or its input file). The driver reports the
+// message; nothing below it terminates the process, so a server or worker thread can carry
+// on with the next compile.
+class CompileError : public std::runtime_error {
+public:
+    inline explicit CompileError(const std::string& message) : std::runtime_error(message) {
+    }
+};
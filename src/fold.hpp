@@ -0,0 +1,261 @@
+#pragma once
+
+#include <optional>
+#include <string>
+#include <vector>
+#include "./error.hpp"
+#include "./parser.hpp"
+#include "./symbols.hpp"
+
+// Constant folding and propagation over the AST, run at -O1 between parsing and code
+// generation. Rewrites nodes in place:
+//  - binary expressions whose operands are constants become int_lit nodes, and the
+//    identities x+0, x-0, x*1, x/1 and, when x can't trap, x*0 are simplified,
+//  - references to a `let` that is never assigned afterwards are replaced by its value
+//    when that value is constant,
+//  - an `if` with a constant condition becomes its scope, or disappears when the
+//    condition is zero, and so does a `while` whose condition is zero.
+// Arithmetic wraps at 64 bits, division is signed and truncates and comparisons are
+// signed, matching the generated code. Divisions that trap (by zero, INT64_MIN / -1) are left for run time.
+//
+// Folding runs before anything else looks at names, and it removes code, so it reports
+// the name errors the generators would: a program that -O0 rejects mustn't compile at -O1
+// just because the offending code folded away.
+class ConstantFolder {
+public:
+    inline ConstantFolder(Ast& ast, const Interner& interner) : m_ast(ast), m_interner(interner) {
+    }
+
+    inline void run() {
+        m_reassigned.assign(m_ast.nodes.size(), false);
+        find_reassigned(m_ast.root);
+        m_vars.clear();
+        fold_stmts(m_ast.root);
+    }
+
+private:
+    struct Binding {
+        NodeIndex let;
+        std::optional<int64_t> value = {};
+    };
+
+    // Pass 1: mark every let that is the target of an assignment.
+    inline void find_reassigned(NodeIndex index) {
+        const Node& stmt = m_ast.nodes[index];
+        switch (stmt.kind) {
+            case NodeKind::prog:
+            case NodeKind::scope:
+                m_vars.begin_scope();
+                for (NodeIndex child : m_ast.children(stmt)) {
+                    find_reassigned(child);
+                }
+                m_vars.end_scope();
+                break;
+            case NodeKind::let:
+                m_vars.declare(stmt.lhs, {.let = index});
+                break;
+            case NodeKind::assign:
+                if (const Binding* binding = m_vars.lookup(stmt.lhs)) {
+                    m_reassigned[binding->let] = true;
+                }
+                break;
+            case NodeKind::if_:
+            case NodeKind::while_:
+                find_reassigned(stmt.rhs);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Pass 2: fold a statement list in place, dropping statements that fold away.
+    inline void fold_stmts(NodeIndex index) {
+        m_vars.begin_scope();
+        Node& list = m_ast.nodes[index];
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < list.rhs; i++) {
+            NodeIndex child = m_ast.lists[list.lhs + i];
+            if (fold_stmt(child)) {
+                m_ast.lists[list.lhs + kept++] = child;
+            }
+        }
+        m_ast.nodes[index].rhs = kept;
+        m_vars.end_scope();
+    }
+
+    // Returns false if the statement should be removed.
+    inline bool fold_stmt(NodeIndex index) {
+        Node stmt = m_ast.nodes[index];
+        switch (stmt.kind) {
+            case NodeKind::exit:
+                fold_expr(stmt.lhs);
+                return true;
+            case NodeKind::let: {
+                auto value = fold_expr(stmt.rhs);
+                if (m_reassigned[index]) {
+                    value.reset();
+                }
+                if (!m_vars.declare(stmt.lhs, {.let = index, .value = value})) {
+                    throw CompileError("Identifier already used.");
+                }
+                return true;
+            }
+            case NodeKind::assign:
+                if (m_vars.lookup(stmt.lhs) == nullptr) {
+                    throw CompileError("Identifier not found.");
+                }
+                fold_expr(stmt.rhs);
+                return true;
+            case NodeKind::print:
+                for (NodeIndex expr : m_ast.children(stmt)) {
+                    fold_expr(expr);
+                }
+                return true;
+            case NodeKind::scope:
+                fold_stmts(index);
+                return true;
+            case NodeKind::if_: {
+                auto cond = fold_expr(stmt.lhs);
+                fold_stmts(stmt.rhs);
+                if (!cond.has_value()) {
+                    return true;
+                }
+                if (cond.value() == 0) {
+                    return false;
+                }
+                // the body still gets its own scope
+                m_ast.nodes[index] = m_ast.nodes[stmt.rhs];
+                return true;
+            }
+            case NodeKind::while_: {
+                // lets assigned in the body were never propagated, so the condition can't
+                // fold to a value that only holds on the first iteration
+                auto cond = fold_expr(stmt.lhs);
+                fold_stmts(stmt.rhs);
+                return cond != 0;
+            }
+            default:
+                return true;
+        }
+    }
+
+    // Folds the expression in place and returns its value if it is now a constant. Operands
+    // are folded before the node using them, walking the expression with an explicit stack
+    // so its depth doesn't matter.
+    inline std::optional<int64_t> fold_expr(NodeIndex index) {
+        size_t base = m_values.size();
+        m_walk.push_back({.index = index});
+        while (!m_walk.empty()) {
+            Pending& top = m_walk.back();
+            NodeIndex node = top.index;
+            if (is_bin_expr(m_ast.nodes[node].kind) && !top.expanded) {
+                top.expanded = true;
+                m_walk.push_back({.index = m_ast.nodes[node].rhs});
+                m_walk.push_back({.index = m_ast.nodes[node].lhs});
+                continue;
+            }
+            m_walk.pop_back();
+            if (!is_bin_expr(m_ast.nodes[node].kind)) {
+                m_values.push_back(fold_leaf(node));
+                continue;
+            }
+            auto rhs = m_values.back();
+            m_values.pop_back();
+            m_values.back() = fold_bin(node, m_values.back(), rhs);
+        }
+        auto value = m_values.back();
+        m_values.resize(base);
+        return value;
+    }
+
+    inline std::optional<int64_t> fold_leaf(NodeIndex index) {
+        Node expr = m_ast.nodes[index];
+        if (expr.kind == NodeKind::int_lit) {
+            return expr.int_value();
+        }
+        if (expr.kind == NodeKind::ident) {
+            const Binding* binding = m_vars.lookup(expr.lhs);
+            if (binding == nullptr) {
+                throw CompileError("Undeclared identifier: " + std::string(m_interner.name(expr.lhs)));
+            }
+            if (!binding->value.has_value()) {
+                return {};
+            }
+            set_int(index, binding->value.value());
+            return binding->value;
+        }
+        return {};
+    }
+
+    // Folds a binary expression whose operands are folded already, given their values.
+    inline std::optional<int64_t> fold_bin(NodeIndex index, std::optional<int64_t> lhs, std::optional<int64_t> rhs) {
+        Node expr = m_ast.nodes[index];
+        if (lhs.has_value() && rhs.has_value()) {
+            auto a = static_cast<uint64_t>(lhs.value());
+            auto b = static_cast<uint64_t>(rhs.value());
+            switch (expr.kind) {
+                case NodeKind::add:
+                    return set_int(index, static_cast<int64_t>(a + b));
+                case NodeKind::sub:
+                    return set_int(index, static_cast<int64_t>(a - b));
+                case NodeKind::mul:
+                    return set_int(index, static_cast<int64_t>(a * b));
+                case NodeKind::div:
+                    // both of these trap at run time
+                    if (b == 0 || (lhs.value() == INT64_MIN && rhs.value() == -1)) {
+                        return {};
+                    }
+                    return set_int(index, lhs.value() / rhs.value());
+                case NodeKind::eq:
+                    return set_int(index, lhs.value() == rhs.value());
+                case NodeKind::ne:
+                    return set_int(index, lhs.value() != rhs.value());
+                case NodeKind::lt:
+                    return set_int(index, lhs.value() < rhs.value());
+                case NodeKind::le:
+                    return set_int(index, lhs.value() <= rhs.value());
+                case NodeKind::gt:
+                    return set_int(index, lhs.value() > rhs.value());
+                case NodeKind::ge:
+                    return set_int(index, lhs.value() >= rhs.value());
+                default:
+                    return {};
+            }
+        }
+        // identities with one constant operand
+        if (rhs == 0 && (expr.kind == NodeKind::add || expr.kind == NodeKind::sub)) {
+            m_ast.nodes[index] = m_ast.nodes[expr.lhs];
+        } else if (lhs == 0 && expr.kind == NodeKind::add) {
+            m_ast.nodes[index] = m_ast.nodes[expr.rhs];
+        } else if (rhs == 1 && (expr.kind == NodeKind::mul || expr.kind == NodeKind::div)) {
+            m_ast.nodes[index] = m_ast.nodes[expr.lhs];
+        } else if (lhs == 1 && expr.kind == NodeKind::mul) {
+            m_ast.nodes[index] = m_ast.nodes[expr.rhs];
+        } else if ((lhs == 0 || rhs == 0) && expr.kind == NodeKind::mul
+                   && !m_ast.can_trap(lhs == 0 ? expr.rhs : expr.lhs, m_stack)) {
+            // the other operand is dropped, so only when that can't trap
+            return set_int(index, 0);
+        }
+        return {};
+    }
+
+    inline int64_t set_int(NodeIndex index, int64_t value) {
+        auto bits = static_cast<uint64_t>(value);
+        m_ast.nodes[index] = {.kind = NodeKind::int_lit,
+            .lhs = static_cast<uint32_t>(bits), .rhs = static_cast<uint32_t>(bits >> 32)};
+        return value;
+    }
+
+    struct Pending {
+        NodeIndex index;
+        bool expanded = false;  // its operands are on the stack above it, or folded
+    };
+
+    Ast& m_ast;
+    const Interner& m_interner;
+    std::vector<bool> m_reassigned;
+    ScopedSymbolTable<Binding> m_vars;
+    std::vector<Pending> m_walk;
+    std::vector<NodeIndex> m_stack;
+    std::vector<std::optional<int64_t>> m_values;   // folded operands waiting for their node
+};
@@ -1,216 +1,605 @@
 #pragma once
 #include <algorithm>
-#include <sstream>
+#include <string>
+#include <vector>
 #include "./parser.hpp"
+#include "./peephole.hpp"
+#include "./regalloc.hpp"
+#include "./runtime.hpp"
+#include "./x86.hpp"
 
+// The -O1 code generator: variables live in the registers LocalRegisterAllocator picks for
+// them, or in stack slots, and expressions are evaluated directly into registers. The
+// result goes through PeepholeOptimizer. -O0 goes through the IR instead (ir_codegen.hpp).
 class Generator {
 public:
 
-    inline explicit Generator(NodeProg root) : m_root(std::move(root)) {};
+    inline explicit Generator(const Ast& ast, const Interner& interner) : m_ast(ast), m_interner(interner) {};
 
-    void gen_term(const NodeTerm* term) {
-        struct TermVisitor {
-            Generator& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output_text << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeTermIdentifier* term_identifier ) const {
-                auto it = std::find_if(gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var& var){return var.name == term_identifier->ident.value.value();});
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier: " << term_identifier->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+    void gen_scope(const Node& scope) {
+        begin_scope();
+        for (NodeIndex stmt : m_ast.children(scope)) {
+            gen_stmt(stmt);
+        }
+        end_scope();
+    }
+    // Leaves the value of the expression in dst. Intermediate values live in temp_regs; only
+    // if those run out does a value go through the stack.
+    void gen_expr_into(NodeIndex index, Reg dst) {
+        gen_expr(index, dst, true);
+    }
+
+    // Compares the operands of a comparison, the left one evaluated into dst, and returns
+    // the condition under which it holds. Nothing is materialized: an `if` branches on the
+    // flags directly.
+    Cond gen_compare(NodeIndex index, Reg dst) {
+        gen_expr(index, dst, false);
+        return condition(m_ast[index].kind);
+    }
+
+    // Generates code for an expression without recursing: every binary expression being
+    // worked on has a frame on m_frames, which records how far along it is, and its
+    // operands get frames of their own on top of it. The left operand is evaluated into
+    // dst, then the right one becomes an operand of the instruction: an immediate, a
+    // variable, a temp register, or, when no temp is free, rax by way of the stack. A
+    // comparison at the root is left in the flags unless materialize is set.
+    void gen_expr(NodeIndex index, Reg dst, bool materialize) {
+        size_t base = m_frames.size();
+        m_frames.push_back({.index = index, .dst = dst, .stage = Stage::start});
+        while (m_frames.size() > base) {
+            size_t top = m_frames.size() - 1;
+            ExprFrame frame = m_frames[top];
+            const Node& expr = m_ast[frame.index];
+            Operand dst_op = reg_operand(frame.dst);
+            bool keep_flags = !materialize && top == base;
+            switch (frame.stage) {
+                case Stage::start:
+                    if (expr.kind == NodeKind::int_lit) {
+                        emit(Op::mov, dst_op, imm_operand(expr.int_value()));
+                        m_frames.pop_back();
+                        break;
+                    }
+                    if (expr.kind == NodeKind::ident) {
+                        emit(Op::mov, dst_op, var_operand(expr.lhs));
+                        m_frames.pop_back();
+                        break;
                     }
-                std::stringstream offset;
-                offset << "QWORD [rsp + " << (gen.m_stack_size-(*it).stack_loc-1) * 8 << "]";
-                gen.push(offset.str());
+                    m_frames[top].lhs = expr.lhs;
+                    m_frames[top].rhs = expr.rhs;
+                    if (expr.kind == NodeKind::mul && m_ast[expr.lhs].kind == NodeKind::int_lit) {
+                        // keep a constant factor on the right
+                        std::swap(m_frames[top].lhs, m_frames[top].rhs);
+                    }
+                    m_frames[top].stage = Stage::lhs_done;
+                    m_frames.push_back({.index = m_frames[top].lhs, .dst = frame.dst, .stage = Stage::start});
+                    break;
+                case Stage::lhs_done: {
+                    const Node& rhs_node = m_ast[frame.rhs];
+                    if (rhs_node.kind == NodeKind::int_lit) {
+                        if (expr.kind == NodeKind::mul) {
+                            gen_mul_const(dst_op, rhs_node.int_value());
+                            m_frames.pop_back();
+                            break;
+                        }
+                        if (expr.kind == NodeKind::div && gen_div_const(dst_op, rhs_node.int_value())) {
+                            m_frames.pop_back();
+                            break;
+                        }
+                    }
+                    if (expr.kind == NodeKind::div && rhs_node.kind != NodeKind::ident && m_free_temps == 0) {
+                        // no register for the divisor: the dividend waits on the stack and goes
+                        // back into rax, the divisor stays in dst
+                        push(dst_op);
+                        m_frames[top].stage = Stage::divisor_done;
+                        m_frames.push_back({.index = frame.rhs, .dst = frame.dst, .stage = Stage::start});
+                        break;
+                    }
+                    // the right operand: an immediate where the instruction takes one, a
+                    // variable, or a value computed into a temp or, failing that, rax
+                    bool imm = expr.kind != NodeKind::div;
+                    if (imm && rhs_node.kind == NodeKind::int_lit && fits_imm32(rhs_node.int_value())) {
+                        finish_expr(imm_operand(rhs_node.int_value()), keep_flags);
+                    } else if (rhs_node.kind == NodeKind::ident) {
+                        finish_expr(var_operand(rhs_node.lhs), keep_flags);
+                    } else if (auto temp = take_temp()) {
+                        m_frames[top].temp = temp;
+                        m_frames[top].stage = Stage::rhs_in_temp;
+                        m_frames.push_back({.index = frame.rhs, .dst = temp.value(), .stage = Stage::start});
+                    } else {
+                        push(dst_op);
+                        m_frames[top].stage = Stage::rhs_on_stack;
+                        m_frames.push_back({.index = frame.rhs, .dst = frame.dst, .stage = Stage::start});
+                    }
+                    break;
+                }
+                case Stage::rhs_in_temp:
+                    finish_expr(reg_operand(frame.temp.value()), keep_flags);
+                    break;
+                case Stage::rhs_on_stack:
+                    emit(Op::mov, rax, dst_op);
+                    pop(dst_op);
+                    finish_expr(rax, keep_flags);
+                    break;
+                case Stage::divisor_done:
+                    pop(rax);
+                    emit(Op::cqo);
+                    emit(Op::idiv, dst_op);
+                    emit(Op::mov, dst_op, rax);
+                    m_frames.pop_back();
+                    break;
             }
-            void operator()(const NodeTermParen* term_paren ) const {
-                gen.gen_expr(term_paren->expr);
+        }
+    }
+
+    // Applies the binary expression on top of m_frames, whose left operand is in its dst,
+    // to rhs, and pops it. A comparison's result stays in the flags if keep_flags is set.
+    void finish_expr(const Operand& rhs, bool keep_flags) {
+        ExprFrame frame = m_frames.back();
+        m_frames.pop_back();
+        NodeKind kind = m_ast[frame.index].kind;
+        Operand dst_op = reg_operand(frame.dst);
+        switch (kind) {
+            case NodeKind::add:
+                emit(Op::add, dst_op, rhs);
+                break;
+            case NodeKind::sub:
+                emit(Op::sub, dst_op, rhs);
+                break;
+            case NodeKind::mul:
+                emit(Op::imul, dst_op, rhs);
+                break;
+            case NodeKind::div:
+                emit(Op::mov, rax, dst_op);
+                emit(Op::cqo);
+                emit(Op::idiv, rhs);
+                emit(Op::mov, dst_op, rax);
+                break;
+            default:
+                emit(Op::cmp, dst_op, rhs);
+                break;
+        }
+        if (frame.temp.has_value()) {
+            release_temp(frame.temp.value());
+        }
+        if (is_comparison(kind) && !keep_flags) {
+            emit(set_op(condition(kind)), reg_operand(frame.dst, 1));
+            emit(Op::movzx, dst_op, reg_operand(frame.dst, 1));
+        }
+    }
+
+    // dst *= factor, with shifts and lea where the factor allows.
+    void gen_mul_const(const Operand& dst, int64_t factor) {
+        // x * -c == -(x * c); INT64_MIN is 2^63 as far as the low 64 bits go
+        bool negate = factor < 0 && factor != INT64_MIN;
+        uint64_t magnitude = negate ? -static_cast<uint64_t>(factor) : static_cast<uint64_t>(factor);
+        if (magnitude == 0) {
+            emit(Op::mov, dst, imm_operand(0));
+            return;
+        }
+        int shift = __builtin_ctzll(magnitude);
+        uint64_t odd = magnitude >> shift;
+        if (odd == 3 || odd == 5 || odd == 9) {
+            emit(Op::lea, dst, mem_operand(dst.reg, dst.reg, static_cast<uint8_t>(odd - 1), 0, 0));
+        } else if (odd != 1) {
+            if (fits_imm32(factor)) {
+                emit(Op::imul, dst, dst, imm_operand(factor));
+            } else {
+                emit(Op::mov, rax, imm_operand(factor));
+                emit(Op::imul, dst, rax);
+            }
+            return;
+        }
+        if (shift > 0) {
+            emit(Op::shl, dst, imm_operand(shift));
+        }
+        if (negate) {
+            emit(Op::neg, dst);
+        }
+    }
+
+    // dst /= divisor, truncating like idiv but without it: an arithmetic shift with a
+    // rounding bias for powers of two, a multiply by a fixed-point reciprocal otherwise.
+    // Returns false for 0, -1 and INT64_MIN, which are left to idiv: dividing by 0 and
+    // INT64_MIN / -1 have to trap like they do at -O0.
+    bool gen_div_const(const Operand& dst, int64_t divisor) {
+        if (divisor == 0 || divisor == -1 || divisor == INT64_MIN) {
+            return false;
+        }
+        Operand rdx = reg_operand(Reg::rdx);
+        uint64_t magnitude = divisor < 0 ? -static_cast<uint64_t>(divisor) : static_cast<uint64_t>(divisor);
+        if ((magnitude & (magnitude - 1)) == 0) {
+            int shift = __builtin_ctzll(magnitude);
+            if (shift > 0) {
+                // negative dividends get 2^shift - 1 added so the shift rounds toward zero
+                emit(Op::mov, rax, dst);
+                if (shift > 1) {
+                    emit(Op::sar, rax, imm_operand(63));
+                }
+                emit(Op::shr, rax, imm_operand(64 - shift));
+                emit(Op::add, rax, dst);
+                emit(Op::sar, rax, imm_operand(shift));
+                emit(Op::mov, dst, rax);
             }
-        };
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
-    }
-    void gen_bin_exp(const NodeBinExpr* bin_expr) {
-        struct BinExprVisitor {
-            Generator& gen;
-            void operator()(const NodeBinExprAdd* add_expr) {
-                gen.gen_expr(add_expr->lhs);
-                gen.gen_expr(add_expr->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output_text << "    ADD rax, rbx\n";
-                gen.push("rax");
+            if (divisor < 0) {
+                emit(Op::neg, dst);
             }
-            void operator()(const NodeBinExprMul* mul_expr) {
-                gen.gen_expr(mul_expr->lhs);
-                gen.gen_expr(mul_expr->rhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output_text << "    mul rbx\n";
-                gen.push("rax");
+            return true;
+        }
+        DivisionMagic magic = division_magic(divisor);
+        emit(Op::mov, rax, imm_operand(magic.multiplier));
+        emit(Op::imul, dst);
+        if (divisor > 0 && magic.multiplier < 0) {
+            emit(Op::add, rdx, dst);
+        } else if (divisor < 0 && magic.multiplier > 0) {
+            emit(Op::sub, rdx, dst);
+        }
+        if (magic.shift > 0) {
+            emit(Op::sar, rdx, imm_operand(magic.shift));
+        }
+        // add one if the quotient is negative
+        emit(Op::mov, rax, rdx);
+        emit(Op::shr, rax, imm_operand(63));
+        emit(Op::add, rdx, rax);
+        emit(Op::mov, dst, rdx);
+        return true;
+    }
+
+    // Every temp register is free between statements.
+    void gen_stmt(NodeIndex index) {
+        const Node& stmt = m_ast[index];
+        switch (stmt.kind) {
+            case NodeKind::exit: {
+                Reg value = take_temp().value();
+                gen_expr_into(stmt.lhs, value);
+                emit(Op::mov, reg_operand(Reg::rdi), reg_operand(value));
+                append_exit(m_asm.instrs, m_asm.prints, m_asm.target);
+                release_temp(value);
+                break;
             }
-            void operator()(const NodeBinExprSub* sub_expr) {
-                gen.gen_expr(sub_expr->rhs); //because this is a stack we need first the rhs then lhs
-                gen.gen_expr(sub_expr->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output_text << "    sub rax, rbx\n";
-                gen.push("rax");
+            case NodeKind::let: {
+                // The initializer is evaluated before the name is bound, so it can't refer
+                // to the variable it initializes.
+                auto reg = m_let_regs.find(index);
+                Var var {.stack_loc = m_stack_size};
+                if (reg != m_let_regs.end()) {
+                    var.reg = reg->second;
+                    gen_expr_into(stmt.rhs, reg->second);
+                } else if (m_loop_slot.has_value()) {
+                    // in a loop the slot was reserved up front
+                    var.stack_loc = m_loop_slot.value()++;
+                    Reg value = take_temp().value();
+                    gen_expr_into(stmt.rhs, value);
+                    emit(Op::mov, mem_operand(Reg::rsp, (m_stack_size - var.stack_loc - 1) * 8), reg_operand(value));
+                    release_temp(value);
+                } else {
+                    Reg value = take_temp().value();
+                    gen_expr_into(stmt.rhs, value);
+                    push(reg_operand(value));
+                    release_temp(value);
+                }
+                if (!m_vars.declare(stmt.lhs, var)) {
+                    throw CompileError("Identifier already used.");
+                }
+                break;
             }
-            void operator()(const NodeBinExprDiv* sub_expr) {
-                gen.gen_expr(sub_expr->rhs); //because this is a stack we need first the rhs then lhs
-                gen.gen_expr(sub_expr->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output_text << "    div rbx\n";
-                gen.push("rax");
+            case NodeKind::print: {
+                auto children = m_ast.children(stmt);
+                for (auto it = children.begin(); it != children.end();) {
+                    // runs of constants go to the string table and are printed by one call
+                    size_t offset = m_asm.strings.size();
+                    for (; it != children.end() && m_ast[*it].kind == NodeKind::int_lit; ++it) {
+                        m_asm.strings += static_cast<char>(m_ast[*it].int_value());
+                    }
+                    if (m_asm.strings.size() - offset == 1) {
+                        m_asm.strings.pop_back();
+                        emit(Op::mov, rax, imm_operand(static_cast<uint8_t>(m_ast[*(it - 1)].int_value())));
+                        append_print_char(m_asm.instrs);
+                    } else if (m_asm.strings.size() > offset) {
+                        append_print_string(m_asm.instrs, offset, m_asm.strings.size() - offset);
+                    }
+                    if (it == children.end()) {
+                        break;
+                    }
+                    Reg value = take_temp().value();
+                    gen_expr_into(*it++, value);
+                    emit(Op::mov, rax, reg_operand(value));
+                    append_print_char(m_asm.instrs);
+                    release_temp(value);
+                }
+                break;
             }
-        };
-
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
-    }
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            Generator& gen;
-            void operator()(const NodeTerm* term) {
-                gen.gen_term(term);
+            case NodeKind::assign: {
+                const Var* found = m_vars.lookup(stmt.lhs);
+                if (found == nullptr) {
+                    throw CompileError("Identifier not found.");
+                }
+                Var var = *found;
+                if (var.reg.has_value() && !reads_symbol(stmt.rhs, stmt.lhs)) {
+                    gen_expr_into(stmt.rhs, var.reg.value());
+                    break;
+                }
+                Reg value = take_temp().value();
+                gen_expr_into(stmt.rhs, value);
+                emit(Op::mov, var_operand(stmt.lhs), reg_operand(value));
+                release_temp(value);
+                break;
             }
-            void operator()(const NodeBinExpr* bin_expr) {
-                gen.gen_bin_exp(bin_expr);
+            case NodeKind::scope:
+                gen_scope(stmt);
+                break;
+            case NodeKind::if_: {
+                auto lbl = create_label();
+                gen_branch(stmt.lhs, lbl, false);
+                gen_scope(m_ast[stmt.rhs]);
+                emit(Op::label, lbl);
+                break;
             }
-        };
+            case NodeKind::while_:
+                gen_while(stmt);
+                break;
+            default:
+                break;
+        }
+    }
 
-        ExprVisitor visitor{.gen = *this};
-        std::visit(visitor, expr->var);
+    // Jumps to lbl if the condition is non-zero (jump_if) or zero (!jump_if).
+    void gen_branch(NodeIndex index, const Operand& lbl, bool jump_if) {
+        const Node& cond = m_ast[index];
+        if (cond.kind == NodeKind::int_lit) {
+            if ((cond.int_value() != 0) == jump_if) {
+                emit(Op::jmp, lbl);
+            }
+            return;
+        }
+        Reg value = take_temp().value();
+        if (is_comparison(cond.kind)) {
+            Cond holds = gen_compare(index, value);
+            emit(jump_op(jump_if ? holds : negate(holds)), lbl);
+        } else {
+            gen_expr_into(index, value);
+            emit(Op::test, reg_operand(value), reg_operand(value));
+            emit(jump_if ? Op::jnz : Op::jz, lbl);
+        }
+        release_temp(value);
     }
-    void gen_scope(const NodeScope* node_scope) {
-        begin_scope();
-        for (const NodeStmt* stmt : node_scope->stmts) {
-            gen_stmt(stmt);
+
+    // Loops are bottom-tested: the condition follows the body and jumps back to it, so an
+    // iteration takes one branch, and the entry jumps over the body to the first test. The
+    // body starts 16-byte aligned. Stack slots for the variables declared anywhere in the
+    // body are reserved once around the outermost loop, instead of pushed and dropped every
+    // iteration.
+    void gen_while(const Node& stmt) {
+        const Node& body = m_ast[stmt.rhs];
+        std::optional<size_t> outer_slot = m_loop_slot;
+        size_t reserved = 0;
+        if (!m_loop_slot.has_value()) {
+            reserved = stack_slots(body);
+            m_loop_slot = m_stack_size;
+            if (reserved > 0) {
+                emit(Op::sub, reg_operand(Reg::rsp), imm_operand(static_cast<int64_t>(reserved * 8)));
+                m_stack_size += reserved;
+            }
+        }
+        auto top = create_label();
+        auto check = create_label();
+        const Node& cond = m_ast[stmt.lhs];
+        if (cond.kind != NodeKind::int_lit || cond.int_value() == 0) {
+            emit(Op::jmp, check);
+        }
+        emit(Op::align, imm_operand(16));
+        emit(Op::label, top);
+        gen_scope(body);
+        emit(Op::label, check);
+        gen_branch(stmt.lhs, top, true);
+        m_loop_slot = outer_slot;
+        if (reserved > 0) {
+            emit(Op::add, reg_operand(Reg::rsp), imm_operand(static_cast<int64_t>(reserved * 8)));
+            m_stack_size -= reserved;
         }
-        end_scope();
     }
-    void gen_stmt(const NodeStmt* stmt) {
-           struct StmtVisitor {
-               Generator& gen;
-               void operator()(const NodeStmtExit* stmt_exit) {
-                   gen.gen_expr(stmt_exit->expression);
-                   gen.m_output_text << "    mov rax, 60\n";
-                   gen.pop("rdi");
-                   gen.m_output_text << "    syscall\n";
-               }
-               void operator()(const NodeStmtLet* stmt_let) {
-                   auto it = std::find_if(gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var& var){return var.name == stmt_let->ident.value.value();});
-                   if (it != gen.m_vars.cend()) {
-                       std::cerr << "Identifier already used." << std::endl;
-                       exit(EXIT_FAILURE);
-                   }
-                   gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-                   gen.gen_expr(stmt_let->expr);
-               }
-               void operator()(const NodeStmtPrint* stmt_print) {
-                   if (gen.m_resb_size_print == 0) {
-                       gen.m_resb_size_print=1;
-                       gen.m_output_bss << "    char resb 1\n"; //TODO when adding printing strings, add resb_size_print
-                   }
-                   for (const NodeExpr* expr : stmt_print->expr) {
-                       gen.gen_expr(expr);
-                       gen.pop("rax");
-                       gen.m_output_text << "    mov [char], al\n";
-                       gen.m_output_text << "    mov rsi, char\n";
-                       gen.m_output_text << "    mov rdi, 1\n";
-                       gen.m_output_text << "    mov rdx, 1\n";
-                       gen.m_output_text << "    mov rax, 1\n    syscall\n";
-                   }
-               }
-               void operator()(const NodeStmtAssign* stmt_assign) {
-                   auto it = std::find_if(gen.m_vars.cbegin(),
-                    gen.m_vars.cend(),
-                    [&](const Var& var){return var.name == stmt_assign->ident.value.value();});
-                    if (it == gen.m_vars.cend()) {
-                        std::cerr << "Identifier not found." << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-                   auto var = (*it);
-                   gen.gen_expr(stmt_assign->expr);
-                   gen.pop("rax");
-                   gen.m_output_text << "    mov QWORD [rsp + " << (gen.m_stack_size-var.stack_loc-1) * 8 << "], rax\n";
-               }
-               void operator()(const NodeScope* stmt_scope) {
-                  gen.gen_scope(stmt_scope);
-               }
-               void operator()(const NodeStmtIf* stmt_if) {
-                    gen.gen_expr(stmt_if->expr);
-                   gen.pop("rax");
-                   auto lbl = gen.create_label();
-                   gen.m_output_text << "    test rax, rax\n";
-                   gen.m_output_text << "    jz " << lbl << "\n";
-                   gen.gen_scope(stmt_if->scope);
-                   gen.m_output_text << lbl << ":\n";
-               }
-           };
 
-        StmtVisitor visitor {.gen = *this};
-        std::visit(visitor, stmt->var);
+    // The most stack slots the lets in a scope, and the scopes nested in it, need at once.
+    size_t stack_slots(const Node& scope) const {
+        size_t own = 0;
+        size_t most = 0;
+        for (NodeIndex index : m_ast.children(scope)) {
+            const Node& stmt = m_ast[index];
+            if (stmt.kind == NodeKind::let && !m_let_regs.contains(index)) {
+                most = std::max(most, ++own);
+            } else if (stmt.kind == NodeKind::scope) {
+                most = std::max(most, own + stack_slots(stmt));
+            } else if (stmt.kind == NodeKind::if_ || stmt.kind == NodeKind::while_) {
+                most = std::max(most, own + stack_slots(m_ast[stmt.rhs]));
+            }
+        }
+        return most;
     }
 
-    std::string gen_prog(){
-        m_output_bss << "section .bss\n";
-        m_output_text << "section .text\nglobal _start\n_start:\n";
-        for (const NodeStmt* stmt : m_root.stmts) {
+    const Assembly& gen_prog(Target target = Target::executable) {
+        reset();
+        m_asm.target = target;
+        m_let_regs = LocalRegisterAllocator(m_ast).allocate();
+        m_asm.prints = std::ranges::any_of(m_ast.nodes, [](const Node& node) { return node.kind == NodeKind::print; });
+        auto stmts = m_ast.children(m_ast[m_ast.root]);
+        for (NodeIndex stmt : stmts) {
             gen_stmt(stmt);
         }
-        m_output_text << "    mov rax, 60\n";
-        m_output_text << "    mov rdi, 0\n";
-        m_output_text << "    syscall";
-
-        (m_output_bss << m_output_text.str());
-        return m_output_bss.str();
+        // no epilogue when the program can't get past its last statement
+        if (stmts.empty() || m_ast[stmts.back()].kind != NodeKind::exit) {
+            emit(Op::mov, reg_operand(Reg::rdi), imm_operand(0));
+            append_exit(m_asm.instrs, m_asm.prints, m_asm.target);
+        }
+        PeepholeOptimizer(m_asm.instrs, m_label_count).run();
+        append_runtime(m_asm.instrs, m_asm.prints, m_asm.target);
+        return m_asm;
     }
 private:
-    void push(const std::string& reg) {
-        m_output_text << "    push " << reg << "\n";
+    static constexpr Operand rax = {.kind = Operand::Kind::reg, .reg = Reg::rax};
+
+    // Clears everything left over from a previous gen_prog, which may have thrown halfway.
+    void reset() {
+        m_asm.instrs.clear();
+        m_stack_size = 0;
+        m_asm.strings.clear();
+        m_vars.clear();
+        m_scopes.clear();
+        m_loop_slot.reset();
+        m_label_count = 0;
+        m_let_regs.clear();
+        m_free_temps = all_temps;
+        m_frames.clear();
+    }
+    void emit(Op op, Operand a = {}, Operand b = {}, Operand c = {}) {
+        m_asm.instrs.push_back({.op = op, .a = a, .b = b, .c = c});
+    }
+    // Operand for reading or writing a variable, at the current stack depth.
+    Operand var_operand(SymbolId sym) {
+        const Var* var = m_vars.lookup(sym);
+        if (var == nullptr) {
+            throw CompileError("Undeclared identifier: " + std::string(m_interner.name(sym)));
+        }
+        if (var->reg.has_value()) {
+            return reg_operand(var->reg.value());
+        }
+        return mem_operand(Reg::rsp, (m_stack_size - var->stack_loc - 1) * 8);
+    }
+    struct DivisionMagic {
+        int64_t multiplier;
+        int shift;
+    };
+    // Multiplier and shift for signed division by a constant that isn't 0 or a power of two
+    // (in magnitude), so that x / divisor == high 64 bits of x * multiplier, shifted, plus
+    // the sign fix-ups gen_div_const applies. Hacker's Delight, 10-1.
+    static DivisionMagic division_magic(int64_t divisor) {
+        constexpr uint64_t two63 = uint64_t{1} << 63;
+        uint64_t ad = divisor < 0 ? -static_cast<uint64_t>(divisor) : static_cast<uint64_t>(divisor);
+        uint64_t t = two63 + (static_cast<uint64_t>(divisor) >> 63);
+        uint64_t anc = t - 1 - t % ad;
+        int p = 63;
+        uint64_t q1 = two63 / anc;
+        uint64_t r1 = two63 - q1 * anc;
+        uint64_t q2 = two63 / ad;
+        uint64_t r2 = two63 - q2 * ad;
+        uint64_t delta;
+        do {
+            p++;
+            q1 *= 2;
+            r1 *= 2;
+            if (r1 >= anc) {
+                q1++;
+                r1 -= anc;
+            }
+            q2 *= 2;
+            r2 *= 2;
+            if (r2 >= ad) {
+                q2++;
+                r2 -= ad;
+            }
+            delta = ad - r2;
+        } while (q1 < delta || (q1 == delta && r1 == 0));
+        auto multiplier = static_cast<int64_t>(q2 + 1);
+        return {.multiplier = divisor < 0 ? -multiplier : multiplier, .shift = p - 64};
+    }
+    static Cond condition(NodeKind comparison) {
+        switch (comparison) {
+            case NodeKind::eq:
+                return Cond::e;
+            case NodeKind::ne:
+                return Cond::ne;
+            case NodeKind::lt:
+                return Cond::l;
+            case NodeKind::le:
+                return Cond::le;
+            case NodeKind::gt:
+                return Cond::g;
+            default:
+                return Cond::ge;
+        }
+    }
+    bool reads_symbol(NodeIndex index, SymbolId sym) {
+        bool reads = false;
+        m_ast.visit_expr(index, m_walk, [&](NodeIndex node) {
+            reads |= m_ast[node].kind == NodeKind::ident && m_ast[node].lhs == sym;
+        });
+        return reads;
+    }
+    std::optional<Reg> take_temp() {
+        if (m_free_temps == 0) {
+            return {};
+        }
+        int slot = __builtin_ctz(m_free_temps);
+        m_free_temps &= m_free_temps - 1;
+        return temp_regs[slot];
+    }
+    void release_temp(Reg reg) {
+        for (size_t slot = 0; slot < std::size(temp_regs); slot++) {
+            if (temp_regs[slot] == reg) {
+                m_free_temps |= 1u << slot;
+            }
+        }
+    }
+    void push(const Operand& operand) {
+        emit(Op::push, operand);
         m_stack_size++;
     }
-    void pop(const std::string& reg) {
-        m_output_text << "    pop " << reg << "\n";
+    void pop(const Operand& operand) {
+        emit(Op::pop, operand);
         m_stack_size--;
     }
     void begin_scope() {
-        m_scopes.push_back(m_vars.size());
+        m_vars.begin_scope();
+        m_scopes.push_back({.stack_size = m_stack_size, .loop_slot = m_loop_slot});
     }
+    // Drops the scope's stack slots, if it has any.
     void end_scope() {
-        size_t pop_count = m_vars.size()-m_scopes.back();
-        m_output_text << "    add rsp, " << pop_count * 8 << "\n";
-        m_stack_size -= pop_count;
-        for (int i = 0; i<pop_count; i++) {
-            m_vars.pop_back();
-        }
+        m_vars.end_scope();
+        size_t pop_count = m_stack_size - m_scopes.back().stack_size;
+        m_loop_slot = m_scopes.back().loop_slot;
         m_scopes.pop_back();
+        if (pop_count > 0) {
+            emit(Op::add, reg_operand(Reg::rsp), imm_operand(static_cast<int64_t>(pop_count * 8)));
+        }
+        m_stack_size -= pop_count;
     }
-    std::string create_label() {
-        std::stringstream ss;
-        ss<<"label" << m_label_count++;
-        return ss.str();
+    Operand create_label() {
+        return label_operand(m_label_count++);
     }
     struct Var {
-        std::string name;
         size_t stack_loc;
+        std::optional<Reg> reg {};
+    };
+    struct Scope {
+        size_t stack_size;
+        std::optional<size_t> loop_slot;
+    };
+    enum class Stage : uint8_t {
+        start,
+        lhs_done,       // the left operand is in dst
+        rhs_in_temp,    // and the right one in temp
+        rhs_on_stack,   // and the right one in dst, the left one pushed
+        divisor_done,   // a division: the divisor is in dst, the dividend pushed
+    };
+    struct ExprFrame {
+        NodeIndex index;
+        Reg dst;
+        Stage stage;
+        NodeIndex lhs = 0;
+        NodeIndex rhs = 0;
+        std::optional<Reg> temp {};
     };
+    static constexpr uint32_t all_temps = (1u << std::size(temp_regs)) - 1;
 
-    NodeProg m_root;
-    std::stringstream m_output_text;
-    std::stringstream m_output_bss;
+    const Ast& m_ast;
+    const Interner& m_interner;
+    Assembly m_asm;
     size_t m_stack_size = 0;
-    size_t m_resb_size_print = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
-    int m_label_count = 0;
+    ScopedSymbolTable<Var> m_vars {};
+    std::vector<Scope> m_scopes {};
+    // Inside a loop: the reserved stack slot the next stack-allocated let takes.
+    std::optional<size_t> m_loop_slot {};
+    uint32_t m_label_count = 0;
+    std::unordered_map<NodeIndex, Reg> m_let_regs {};
+    uint32_t m_free_temps = all_temps;
+    std::vector<ExprFrame> m_frames {};     // gen_expr's work list
+    std::vector<NodeIndex> m_walk {};       // for visit_expr
 };
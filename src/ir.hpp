@@ -0,0 +1,407 @@
+#pragma once
+
+#include <algorithm>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "./error.hpp"
+#include "./parser.hpp"
+#include "./symbols.hpp"
+
+// Three-address IR between the AST and x86. Every value is a 64-bit integer held in a
+// virtual register; a program is a list of basic blocks, each a run of instructions ended
+// by an explicit jump, branch or return. Block 0 is the entry, and blocks are laid out in
+// the order they are listed.
+//
+// Virtual registers are storage locations rather than SSA values: a variable keeps its
+// register for its whole scope and every assignment writes it. They are numbered
+// stack-wise, a scope's variables and a statement's temporaries are released when it
+// ends, so the register count is the deepest nesting rather than the program size.
+using VReg = uint32_t;
+using BlockId = uint32_t;
+
+enum class IrOp : uint8_t {
+    imm,    // dst = value
+    copy,   // dst = lhs
+    add,    // dst = lhs <op> rhs
+    sub,
+    mul,
+    div,
+    eq,     // dst = 1 if lhs <op> rhs holds, else 0 (signed)
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    print,  // write the low byte of lhs to stdout
+    print_str, // write lhs bytes of the string table from offset value
+    exit,   // exit(lhs)
+};
+
+struct IrInstr {
+    IrOp op;
+    VReg dst = 0;
+    VReg lhs = 0;
+    VReg rhs = 0;
+    int64_t value = 0;
+};
+
+struct IrTerminator {
+    enum class Kind : uint8_t {
+        jump,   // to target
+        branch, // to target if cond is non-zero, else to other
+        compare, // to target if cond <op> rhs holds, else to other
+        ret,    // exit(0)
+    };
+
+    Kind kind = Kind::ret;
+    VReg cond = 0;
+    VReg rhs = 0;
+    IrOp op = IrOp::eq;
+    BlockId target = 0;
+    BlockId other = 0;
+};
+
+struct IrBlock {
+    std::vector<IrInstr> instrs;
+    IrTerminator term;
+};
+
+struct IrProgram {
+    std::vector<IrBlock> blocks;
+    uint32_t vreg_count = 0;
+    bool prints = false;
+    std::string strings;    // string table of constant print runs
+
+    // Textual form, for --emit-ir.
+    [[nodiscard]] inline std::string dump() const {
+        constexpr const char* op_names[] = {"", "copy", "add", "sub", "mul", "div", "eq", "ne", "lt", "le", "gt", "ge",
+                                             "print", "print", "exit"};
+        std::string out = "; " + std::to_string(vreg_count) + " virtual registers\n";
+        auto v = [](VReg reg) { return "v" + std::to_string(reg); };
+        auto b = [](BlockId block) { return "b" + std::to_string(block); };
+        for (BlockId id = 0; id < blocks.size(); id++) {
+            const IrBlock& block = blocks[id];
+            out += b(id) + ":\n";
+            for (const IrInstr& instr : block.instrs) {
+                out += "    ";
+                switch (instr.op) {
+                    case IrOp::imm:
+                        out += v(instr.dst) + " = " + std::to_string(instr.value);
+                        break;
+                    case IrOp::copy:
+                        out += v(instr.dst) + " = copy " + v(instr.lhs);
+                        break;
+                    case IrOp::print_str:
+                        out += "print \"";
+                        for (char c : std::string_view(strings).substr(instr.value, instr.lhs)) {
+                            if (c >= ' ' && c <= '~' && c != '"' && c != '\\') {
+                                out += c;
+                            } else {
+                                constexpr char digits[] = "0123456789abcdef";
+                                out += "\\x";
+                                out += digits[static_cast<uint8_t>(c) >> 4];
+                                out += digits[c & 15];
+                            }
+                        }
+                        out += "\"";
+                        break;
+                    case IrOp::print:
+                    case IrOp::exit:
+                        out += op_names[static_cast<uint8_t>(instr.op)] + (" " + v(instr.lhs));
+                        break;
+                    default:
+                        out += v(instr.dst) + " = " + op_names[static_cast<uint8_t>(instr.op)] + " "
+                            + v(instr.lhs) + ", " + v(instr.rhs);
+                        break;
+                }
+                out += "\n";
+            }
+            switch (block.term.kind) {
+                case IrTerminator::Kind::jump:
+                    out += "    jmp " + b(block.term.target) + "\n";
+                    break;
+                case IrTerminator::Kind::branch:
+                    out += "    br " + v(block.term.cond) + ", " + b(block.term.target) + ", "
+                        + b(block.term.other) + "\n";
+                    break;
+                case IrTerminator::Kind::compare:
+                    out += "    br " + std::string(op_names[static_cast<uint8_t>(block.term.op)]) + " "
+                        + v(block.term.cond) + ", " + v(block.term.rhs) + ", " + b(block.term.target) + ", "
+                        + b(block.term.other) + "\n";
+                    break;
+                case IrTerminator::Kind::ret:
+                    out += "    ret\n";
+                    break;
+            }
+        }
+        return out;
+    }
+};
+
+// Lowers the AST to IR. Reports the same errors as Generator.
+class IrBuilder {
+public:
+    inline explicit IrBuilder(const Ast& ast, const Interner& interner) : m_ast(ast), m_interner(interner) {
+    }
+
+    inline const IrProgram& build() {
+        for (IrBlock& block : m_program.blocks) {
+            block.instrs.clear();
+        }
+        m_block_count = 0;
+        m_program.vreg_count = 0;
+        m_program.prints = false;
+        m_program.strings.clear();
+        m_vars.clear();
+        m_next_vreg = 0;
+        // left over if the last build threw halfway through an expression
+        m_walk.clear();
+        m_values.clear();
+        m_current = new_block();
+        lower_stmts(m_ast[m_ast.root]);
+        block().term = {.kind = IrTerminator::Kind::ret};
+        m_program.blocks.resize(m_block_count);
+        return m_program;
+    }
+
+    // Result of the last build.
+    [[nodiscard]] inline const IrProgram& program() const {
+        return m_program;
+    }
+
+private:
+    inline IrBlock& block() {
+        return m_program.blocks[m_current];
+    }
+
+    inline BlockId new_block() {
+        // blocks are reused across builds so their instruction vectors keep their capacity
+        if (m_block_count == m_program.blocks.size()) {
+            m_program.blocks.emplace_back();
+        }
+        m_program.blocks[m_block_count].term = {};
+        return m_block_count++;
+    }
+
+    inline VReg new_vreg() {
+        VReg reg = m_next_vreg++;
+        m_program.vreg_count = std::max(m_program.vreg_count, m_next_vreg);
+        return reg;
+    }
+
+    inline void add(IrOp op, VReg dst, VReg lhs = 0, VReg rhs = 0, int64_t value = 0) {
+        block().instrs.push_back({.op = op, .dst = dst, .lhs = lhs, .rhs = rhs, .value = value});
+    }
+
+    inline VReg var(SymbolId sym) {
+        const VReg* reg = m_vars.lookup(sym);
+        if (reg == nullptr) {
+            throw CompileError("Undeclared identifier: " + std::string(m_interner.name(sym)));
+        }
+        return *reg;
+    }
+
+    // Evaluates an expression into dst, or into wherever is convenient if dst is empty, and
+    // returns the register holding the value. Operands are lowered before the operation
+    // using them, in a walk with an explicit stack, so deep expressions don't recurse.
+    inline VReg lower_expr(NodeIndex index, std::optional<VReg> dst = {}) {
+        size_t base = m_values.size();
+        m_walk.push_back({.index = index});
+        while (!m_walk.empty()) {
+            Pending& top = m_walk.back();
+            const Node& expr = m_ast[top.index];
+            // only the expression as a whole goes into dst
+            std::optional<VReg> into = m_walk.size() == 1 ? dst : std::nullopt;
+            if (is_bin_expr(expr.kind) && !top.expanded) {
+                top.expanded = true;
+                m_walk.push_back({.index = expr.rhs});
+                m_walk.push_back({.index = expr.lhs});
+                continue;
+            }
+            m_walk.pop_back();
+            if (expr.kind == NodeKind::ident) {
+                VReg reg = var(expr.lhs);
+                if (into.has_value() && into.value() != reg) {
+                    add(IrOp::copy, into.value(), reg);
+                    reg = into.value();
+                }
+                m_values.push_back(reg);
+            } else if (expr.kind == NodeKind::int_lit) {
+                VReg reg = into.has_value() ? into.value() : new_vreg();
+                add(IrOp::imm, reg, 0, 0, expr.int_value());
+                m_values.push_back(reg);
+            } else {
+                VReg rhs = m_values.back();
+                m_values.pop_back();
+                VReg lhs = m_values.back();
+                VReg reg = into.has_value() ? into.value() : new_vreg();
+                add(bin_op(expr.kind), reg, lhs, rhs);
+                m_values.back() = reg;
+            }
+        }
+        VReg reg = m_values.back();
+        m_values.resize(base);
+        return reg;
+    }
+
+    static inline IrOp bin_op(NodeKind kind) {
+        switch (kind) {
+            case NodeKind::add:
+                return IrOp::add;
+            case NodeKind::sub:
+                return IrOp::sub;
+            case NodeKind::mul:
+                return IrOp::mul;
+            case NodeKind::div:
+                return IrOp::div;
+            case NodeKind::eq:
+                return IrOp::eq;
+            case NodeKind::ne:
+                return IrOp::ne;
+            case NodeKind::lt:
+                return IrOp::lt;
+            case NodeKind::le:
+                return IrOp::le;
+            case NodeKind::gt:
+                return IrOp::gt;
+            default:
+                return IrOp::ge;
+        }
+    }
+
+    // Evaluates a condition for a branch, whose targets the caller fills in. A comparison
+    // branches on its operands instead of materializing 0 or 1.
+    inline IrTerminator lower_condition(NodeIndex index) {
+        const Node& cond = m_ast[index];
+        if (is_comparison(cond.kind)) {
+            VReg lhs = lower_expr(cond.lhs);
+            VReg rhs = lower_expr(cond.rhs);
+            return {.kind = IrTerminator::Kind::compare, .cond = lhs, .rhs = rhs, .op = bin_op(cond.kind)};
+        }
+        return {.kind = IrTerminator::Kind::branch, .cond = lower_expr(index)};
+    }
+
+    inline void lower_stmts(const Node& list) {
+        for (NodeIndex stmt : m_ast.children(list)) {
+            lower_stmt(stmt);
+        }
+    }
+
+    inline void lower_scope(const Node& scope) {
+        VReg base = m_next_vreg;
+        m_vars.begin_scope();
+        lower_stmts(scope);
+        m_vars.end_scope();
+        m_next_vreg = base;
+    }
+
+    inline void lower_stmt(NodeIndex index) {
+        const Node& stmt = m_ast[index];
+        // temporaries die with the statement that needs them
+        VReg base = m_next_vreg;
+        switch (stmt.kind) {
+            case NodeKind::exit:
+                add(IrOp::exit, 0, lower_expr(stmt.lhs));
+                break;
+            case NodeKind::let: {
+                VReg reg = new_vreg();
+                lower_expr(stmt.rhs, reg);
+                if (!m_vars.declare(stmt.lhs, reg)) {
+                    throw CompileError("Identifier already used.");
+                }
+                base = m_next_vreg = reg + 1;
+                break;
+            }
+            case NodeKind::assign: {
+                const VReg* reg = m_vars.lookup(stmt.lhs);
+                if (reg == nullptr) {
+                    throw CompileError("Identifier not found.");
+                }
+                lower_expr(stmt.rhs, *reg);
+                break;
+            }
+            case NodeKind::print: {
+                m_program.prints = true;
+                std::string& strings = m_program.strings;
+                auto children = m_ast.children(stmt);
+                for (auto it = children.begin(); it != children.end();) {
+                    size_t offset = strings.size();
+                    for (; it != children.end() && m_ast[*it].kind == NodeKind::int_lit; ++it) {
+                        strings += static_cast<char>(m_ast[*it].int_value());
+                    }
+                    if (strings.size() - offset > 1) {
+                        add(IrOp::print_str, 0, static_cast<VReg>(strings.size() - offset), 0, static_cast<int64_t>(offset));
+                    } else if (strings.size() > offset) {
+                        // a lone constant isn't worth a string table entry
+                        strings.pop_back();
+                        add(IrOp::print, 0, lower_expr(*(it - 1)));
+                        m_next_vreg = base;
+                    }
+                    if (it != children.end()) {
+                        add(IrOp::print, 0, lower_expr(*it++));
+                        m_next_vreg = base;
+                    }
+                }
+                break;
+            }
+            case NodeKind::scope:
+                lower_scope(stmt);
+                break;
+            case NodeKind::if_: {
+                IrTerminator branch = lower_condition(stmt.lhs);
+                BlockId head = m_current;
+                BlockId then = new_block();
+                m_next_vreg = base;
+                m_current = then;
+                lower_scope(m_ast[stmt.rhs]);
+                // created after the body so blocks stay in layout order
+                BlockId join = new_block();
+                block().term = {.kind = IrTerminator::Kind::jump, .target = join};
+                branch.target = then;
+                branch.other = join;
+                m_program.blocks[head].term = branch;
+                m_current = join;
+                break;
+            }
+            case NodeKind::while_: {
+                // bottom-tested: the entry jumps to the condition, laid out after the body,
+                // which branches back to the body
+                BlockId head = m_current;
+                BlockId body = new_block();
+                m_current = body;
+                lower_scope(m_ast[stmt.rhs]);
+                BlockId check = new_block();
+                block().term = {.kind = IrTerminator::Kind::jump, .target = check};
+                m_program.blocks[head].term = {.kind = IrTerminator::Kind::jump, .target = check};
+                m_current = check;
+                IrTerminator branch = lower_condition(stmt.lhs);
+                BlockId exit = new_block();
+                branch.target = body;
+                branch.other = exit;
+                block().term = branch;
+                m_current = exit;
+                break;
+            }
+            default:
+                break;
+        }
+        m_next_vreg = base;
+    }
+
+    const Ast& m_ast;
+    const Interner& m_interner;
+    IrProgram m_program;
+    uint32_t m_block_count = 0;
+    BlockId m_current = 0;
+    struct Pending {
+        NodeIndex index;
+        bool expanded = false;  // its operands are on the stack above it, or lowered
+    };
+
+    ScopedSymbolTable<VReg> m_vars;
+    VReg m_next_vreg = 0;
+    std::vector<Pending> m_walk;
+    std::vector<VReg> m_values;     // lowered operands waiting for their operation
+};
@@ -0,0 +1,169 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "./ir.hpp"
+#include "./runtime.hpp"
+#include "./x86.hpp"
+
+// Straightforward IR -> x86 lowering used at -O0. Every virtual register has a stack slot
+// in a frame reserved on entry; each instruction loads its left operand into rax, computes
+// with the right one straight from memory, and stores the result back. Block n starts at
+// label n, and a jump to the block laid out next falls through.
+class IrGenerator {
+public:
+    inline explicit IrGenerator(const IrProgram& program) : m_program(program) {
+    }
+
+    inline const Assembly& gen_prog(Target target = Target::executable) {
+        m_asm.instrs.clear();
+        m_asm.target = target;
+        m_asm.prints = m_program.prints;
+        m_asm.strings = m_program.strings;
+        if (m_program.vreg_count > 0) {
+            emit(Op::sub, rsp, imm_operand(int64_t{m_program.vreg_count} * 8));
+        }
+        for (BlockId id = 0; id < m_program.blocks.size(); id++) {
+            const IrBlock& block = m_program.blocks[id];
+            if (id > 0) {
+                emit(Op::label, label_operand(id));
+            }
+            for (const IrInstr& instr : block.instrs) {
+                gen_instr(instr);
+            }
+            gen_terminator(block.term, id);
+        }
+        append_runtime(m_asm.instrs, m_asm.prints, m_asm.target);
+        return m_asm;
+    }
+
+private:
+    static constexpr Operand rax = {.kind = Operand::Kind::reg, .reg = Reg::rax};
+    static constexpr Operand rsp = {.kind = Operand::Kind::reg, .reg = Reg::rsp};
+
+    inline void emit(Op op, Operand a = {}, Operand b = {}) {
+        m_asm.instrs.push_back({.op = op, .a = a, .b = b});
+    }
+
+    static inline Operand slot(VReg reg) {
+        return mem_operand(Reg::rsp, int64_t{reg} * 8);
+    }
+
+    inline void gen_instr(const IrInstr& instr) {
+        switch (instr.op) {
+            case IrOp::imm:
+                if (fits_imm32(instr.value)) {
+                    emit(Op::mov, slot(instr.dst), imm_operand(instr.value));
+                } else {
+                    emit(Op::mov, rax, imm_operand(instr.value));
+                    emit(Op::mov, slot(instr.dst), rax);
+                }
+                break;
+            case IrOp::copy:
+                emit(Op::mov, rax, slot(instr.lhs));
+                emit(Op::mov, slot(instr.dst), rax);
+                break;
+            case IrOp::add:
+                emit(Op::mov, rax, slot(instr.lhs));
+                emit(Op::add, rax, slot(instr.rhs));
+                emit(Op::mov, slot(instr.dst), rax);
+                break;
+            case IrOp::sub:
+                emit(Op::mov, rax, slot(instr.lhs));
+                emit(Op::sub, rax, slot(instr.rhs));
+                emit(Op::mov, slot(instr.dst), rax);
+                break;
+            case IrOp::mul:
+                emit(Op::mov, rax, slot(instr.lhs));
+                emit(Op::imul, rax, slot(instr.rhs));
+                emit(Op::mov, slot(instr.dst), rax);
+                break;
+            case IrOp::div:
+                emit(Op::mov, rax, slot(instr.lhs));
+                emit(Op::cqo);
+                emit(Op::idiv, slot(instr.rhs));
+                emit(Op::mov, slot(instr.dst), rax);
+                break;
+            case IrOp::eq:
+            case IrOp::ne:
+            case IrOp::lt:
+            case IrOp::le:
+            case IrOp::gt:
+            case IrOp::ge:
+                emit(Op::mov, rax, slot(instr.lhs));
+                emit(Op::cmp, rax, slot(instr.rhs));
+                emit(set_op(cond(instr.op)), reg_operand(Reg::rax, 1));
+                emit(Op::movzx, rax, reg_operand(Reg::rax, 1));
+                emit(Op::mov, slot(instr.dst), rax);
+                break;
+            case IrOp::print:
+                emit(Op::mov, rax, slot(instr.lhs));
+                append_print_char(m_asm.instrs);
+                break;
+            case IrOp::print_str:
+                append_print_string(m_asm.instrs, instr.value, instr.lhs);
+                break;
+            case IrOp::exit:
+                emit(Op::mov, reg_operand(Reg::rdi), slot(instr.lhs));
+                append_exit(m_asm.instrs, m_asm.prints, m_asm.target);
+                break;
+        }
+    }
+
+    inline void gen_terminator(const IrTerminator& term, BlockId id) {
+        switch (term.kind) {
+            case IrTerminator::Kind::jump:
+                if (term.target != id + 1) {
+                    emit(Op::jmp, label_operand(term.target));
+                }
+                break;
+            case IrTerminator::Kind::branch:
+                emit(Op::mov, rax, slot(term.cond));
+                emit(Op::test, rax, rax);
+                gen_branch(Cond::ne, term, id);
+                break;
+            case IrTerminator::Kind::compare:
+                emit(Op::mov, rax, slot(term.cond));
+                emit(Op::cmp, rax, slot(term.rhs));
+                gen_branch(cond(term.op), term, id);
+                break;
+            case IrTerminator::Kind::ret:
+                emit(Op::mov, reg_operand(Reg::rdi), imm_operand(0));
+                append_exit(m_asm.instrs, m_asm.prints, m_asm.target);
+                break;
+        }
+    }
+
+    // Branches to term.target if taken holds and to term.other if not, falling through to
+    // whichever of them is laid out next.
+    inline void gen_branch(Cond taken, const IrTerminator& term, BlockId id) {
+        if (term.other == id + 1) {
+            emit(jump_op(taken), label_operand(term.target));
+            return;
+        }
+        emit(jump_op(negate(taken)), label_operand(term.other));
+        if (term.target != id + 1) {
+            emit(Op::jmp, label_operand(term.target));
+        }
+    }
+
+    static inline Cond cond(IrOp op) {
+        switch (op) {
+            case IrOp::eq:
+                return Cond::e;
+            case IrOp::ne:
+                return Cond::ne;
+            case IrOp::lt:
+                return Cond::l;
+            case IrOp::le:
+                return Cond::le;
+            case IrOp::gt:
+                return Cond::g;
+            default:
+                return Cond::ge;
+        }
+    }
+
+    const IrProgram& m_program;
+    Assembly m_asm;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include "./encoder.hpp"
+#include "./error.hpp"
+#include "./runtime.hpp"
+#include "./x86.hpp"
+
+// Runs encoded code inside the compiler's process, for --run. The code and the string
+// table go into one mapping, read+execute once they are in place, followed by read+write
+// pages for the output buffer and host_rsp. The mapping is in the low 2 GiB (MAP_32BIT)
+// because the code refers to data by 32-bit absolute address, as it does at elf_base.
+//
+// The code must have been generated for Target::jit: it is called through pigeon_enter
+// and returns its exit code from pigeon_exit. A program that faults takes the compiler
+// down with it, just like running the executable would.
+class JitRunner {
+public:
+    // Returns the program's exit code.
+    inline int64_t run(X86Encoder& encoder, const Assembly& assembly) {
+        const std::vector<uint8_t>& code = encoder.code();
+        size_t strings_offset = code.size();
+        size_t data_offset = align(strings_offset + assembly.strings.size());
+        size_t size = data_offset + align(print_buffer_size + 16);
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (mapping == MAP_FAILED) {
+            throw CompileError("Unable to map memory for --run");
+        }
+        auto base = reinterpret_cast<uint64_t>(mapping);
+        auto unmap = [&] {
+            munmap(mapping, size);
+        };
+        try {
+            encoder.patch_data(base, [&](std::string_view sym) {
+                return data_address(sym, base + strings_offset, base + data_offset);
+            });
+        } catch (...) {
+            unmap();
+            throw;
+        }
+        auto* bytes = static_cast<uint8_t*>(mapping);
+        std::memcpy(bytes, code.data(), code.size());
+        std::memcpy(bytes + strings_offset, assembly.strings.data(), assembly.strings.size());
+        if (mprotect(mapping, data_offset, PROT_READ | PROT_EXEC) != 0) {
+            unmap();
+            throw CompileError("Unable to map memory for --run");
+        }
+
+        using Entry = int64_t (*)(uint64_t program);
+        auto enter = reinterpret_cast<Entry>(bytes + encoder.symbol_offset("pigeon_enter"));
+        int64_t status = enter(base);
+        unmap();
+        return status;
+    }
+
+private:
+    static inline size_t align(size_t value) {
+        return (value + page - 1) & ~(page - 1);
+    }
+
+    static inline uint64_t data_address(std::string_view sym, uint64_t strings, uint64_t data) {
+        if (sym == "strings") {
+            return strings;
+        }
+        if (sym == "outbuf") {
+            return data;
+        }
+        if (sym == "outpos") {
+            return data + print_buffer_size;
+        }
+        if (sym == "host_rsp") {
+            return data + print_buffer_size + 8;
+        }
+        throw CompileError("Internal error: undefined symbol " + std::string(sym));
+    }
+
+    static constexpr size_t page = 0x1000;
+};
@@ -1,42 +1,245 @@
+#include <charconv>
 #include <iostream>
-#include <fstream>
+#include <memory>
 #include <optional>
-#include <sstream>
+#include <string>
+#include <thread>
 #include <vector>
-#include "./arena.hpp"
-#include "./tokenization.hpp"
-#include "./parser.hpp"
-#include "./generation.hpp"
+#include "./compiler.hpp"
+#include "./server.hpp"
+#include "./thread_pool.hpp"
+
+static int usage() {
+    std::cerr << "Incorrect usage, correct usage:" << std::endl;
+    std::cerr << "pig [-O0|-O1] [--emit-ir] [--emit-asm] [--ast-stats] [-o <output>] <input.pig>" << std::endl;
+    std::cerr << "pig [-O0|-O1] [--emit-ir] [--emit-asm] [--ast-stats] [-j <threads>] <input.pig> <input.pig>..." << std::endl;
+    std::cerr << "pig [--time-passes] [--stats=json] [options] <input.pig>..." << std::endl;
+    std::cerr << "pig --cache <dir> [--cache-limit <MiB>] [--cache-stats] [options] <input.pig>..." << std::endl;
+    std::cerr << "pig --run [-O0|-O1] [--emit-ir] [--emit-asm] [-o <output>] <input.pig>" << std::endl;
+    std::cerr << "pig --server <socket>" << std::endl;
+    std::cerr << "pig --client <socket> [-O0|-O1] [--emit-ir] [--emit-asm] [-o <output>] <input.pig>" << std::endl;
+    return EXIT_FAILURE;
+}
+
+// A whole argument as a decimal number, or nothing if it isn't one.
+static std::optional<uint64_t> parse_number(std::string_view arg) {
+    uint64_t value = 0;
+    auto [end, ec] = std::from_chars(arg.data(), arg.data() + arg.size(), value);
+    if (ec != std::errc() || end != arg.data() + arg.size()) {
+        return {};
+    }
+    return value;
+}
+
+struct FileStats {
+    std::string input;
+    CompileStats stats;
+};
+
+// --time-passes goes to stderr, --stats=json to stdout, so dashboards can read it apart
+// from diagnostics.
+static void report_stats(const std::vector<FileStats>& files, bool text, bool json, double start_ms) {
+    double wall_ms = PassClock::now(CLOCK_MONOTONIC) - start_ms;
+    if (text) {
+        for (const FileStats& file : files) {
+            std::cerr << file.input << ":\n" << format_stats(file.stats) << std::endl;
+        }
+        std::string totals = "total: ";
+        append_ms(totals, wall_ms);
+        totals += " ms wall, ";
+        append_ms(totals, process_cpu_ms());
+        std::cerr << totals << " ms cpu, peak RSS " << peak_rss_kib() << " KiB" << std::endl;
+    }
+    if (json) {
+        std::string out = "{\"files\": [";
+        for (size_t i = 0; i < files.size(); i++) {
+            out += i == 0 ? "" : ", ";
+            append_json(out, files[i].input, files[i].stats);
+        }
+        out += "], \"wall_ms\": ";
+        append_ms(out, wall_ms);
+        out += ", \"cpu_ms\": ";
+        append_ms(out, process_cpu_ms());
+        out += ", \"peak_rss_kib\": " + std::to_string(peak_rss_kib()) + "}";
+        std::cout << out << std::endl;
+    }
+}
+
+// foo/bar.pig -> foo/bar
+static std::string output_for(const std::string& input) {
+    if (input.ends_with(".pig")) {
+        return input.substr(0, input.size() - 4);
+    }
+    return input + ".out";
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        std::cerr << "Incorrect usage, correct usage:" << std::endl;
-        std::cerr << "pig <input.pig>" << std::endl;
-        return EXIT_FAILURE;
-    }
-
-    std::string contents;
-    {
-        std::stringstream contents_stream;
-        std::fstream input(argv[1], std::ios::in);
-        contents_stream << input.rdbuf();
-        contents = contents_stream.str();
-    }
-    Tokenizer tokenizer(contents);
-    {
-        std::fstream file("out.asm", std::ios::out);
-        std::vector<Token> tokens = tokenizer.tokenize();
-        Parser parser(std::move(tokens));
-        std::optional<NodeProg> root = parser.parse_prog();
-        if (!root.has_value()) {
-            std::cerr << "Invalid program" << std::endl;
-            exit(EXIT_FAILURE);
-        }
-        Generator generator(root.value());
-        file << generator.gen_prog();
-    }
-
-    system("nasm -felf64 out.asm");
-    system("ld -o out out.o");
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    double start_ms = PassClock::now(CLOCK_MONOTONIC);
+    std::vector<std::string> inputs;
+    std::optional<std::string> output;
+    const char* server_socket = nullptr;
+    const char* client_socket = nullptr;
+    bool ast_stats = false;
+    bool run = false;
+    const char* cache_dir = nullptr;
+    uint64_t cache_limit = 256;
+    bool cache_stats = false;
+    bool time_passes = false;
+    bool stats_json = false;
+    CompileOptions options;
+    size_t threads = std::thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg = argv[i];
+        if (arg == "-O0" || arg == "-O1") {
+            options.opt_level = arg[2] - '0';
+        } else if (arg == "--emit-ir") {
+            options.emit_ir = true;
+        } else if (arg == "--emit-asm") {
+            options.emit_asm = true;
+        } else if (arg == "--ast-stats") {
+            ast_stats = true;
+        } else if (arg == "--time-passes") {
+            time_passes = true;
+        } else if (arg == "--stats=json") {
+            stats_json = true;
+        } else if (arg == "--run") {
+            run = true;
+        } else if (arg == "-o" && i + 1 < argc) {
+            output = argv[++i];
+        } else if (arg == "-j" && i + 1 < argc) {
+            auto value = parse_number(argv[++i]);
+            if (!value.has_value()) {
+                return usage();
+            }
+            threads = value.value();
+        } else if (arg == "--cache" && i + 1 < argc) {
+            cache_dir = argv[++i];
+        } else if (arg == "--cache-limit" && i + 1 < argc) {
+            // in MiB, and the limit in bytes has to fit
+            auto value = parse_number(argv[++i]);
+            if (!value.has_value() || value.value() > UINT64_MAX >> 20) {
+                return usage();
+            }
+            cache_limit = value.value();
+        } else if (arg == "--cache-stats") {
+            cache_stats = true;
+        } else if (arg == "--server" && i + 1 < argc) {
+            server_socket = argv[++i];
+        } else if (arg == "--client" && i + 1 < argc) {
+            client_socket = argv[++i];
+        } else if (!arg.starts_with("-")) {
+            inputs.emplace_back(arg);
+        } else {
+            return usage();
+        }
+    }
+
+    if (server_socket != nullptr) {
+        return inputs.empty() ? run_server(server_socket) : usage();
+    }
+    if ((cache_dir == nullptr && cache_stats) || (cache_dir != nullptr && (run || client_socket != nullptr))
+        || (client_socket != nullptr && (time_passes || stats_json))) {
+        return usage();
+    }
+    if ((inputs.empty() && !cache_stats) || (inputs.size() > 1 && (output.has_value() || client_socket != nullptr))) {
+        return usage();
+    }
+    if (client_socket != nullptr) {
+        return run ? usage() : run_client(client_socket, inputs.front(), output.value_or("out"), options);
+    }
+    if (run) {
+        if (inputs.size() > 1) {
+            return usage();
+        }
+        Compiler compiler;
+        compiler.measure(time_passes || stats_json);
+        int64_t status;
+        try {
+            status = compiler.run(inputs.front(), output.value_or("out"), options);
+        } catch (const CompileError& error) {
+            std::cerr << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+        if (time_passes || stats_json) {
+            report_stats({{.input = inputs.front(), .stats = compiler.stats()}}, time_passes, stats_json, start_ms);
+        }
+        // like a process exit status, only the low byte is kept
+        return static_cast<uint8_t>(status);
+    }
+
+    // A single input keeps the historical default output name; several inputs each get
+    // their own, next to the source.
+    std::vector<std::string> outputs;
+    for (const std::string& input : inputs) {
+        outputs.push_back(inputs.size() == 1 ? output.value_or("out") : output_for(input));
+    }
+
+    std::unique_ptr<CompileCache> cache;
+    if (cache_dir != nullptr) {
+        try {
+            cache = std::make_unique<CompileCache>(cache_dir, cache_limit << 20);
+        } catch (const CompileError& error) {
+            std::cerr << error.what() << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    WorkStealingPool pool(threads);
+    std::vector<Compiler> compilers(pool.threads());
+    // --ast-stats needs every file parsed, so it doesn't use the cache
+    for (Compiler& compiler : compilers) {
+        compiler.use_cache(ast_stats ? nullptr : cache.get());
+        compiler.measure(time_passes || stats_json);
+    }
+    struct FileResult {
+        std::string diagnostic;
+        bool failed = false;
+        CompileStats stats;
+    };
+    std::vector<FileResult> results(inputs.size());
+    pool.run(inputs.size(), [&](size_t worker, size_t i) {
+        Compiler& compiler = compilers[worker];
+        try {
+            compiler.compile(inputs[i], outputs[i], options);
+        } catch (const CompileError& error) {
+            results[i].diagnostic = error.what();
+            results[i].failed = true;
+            return;
+        }
+        results[i].stats = compiler.stats();
+        if (ast_stats) {
+            const Ast& ast = compiler.ast();
+            results[i].diagnostic = "ast: " + std::to_string(ast.nodes.size()) + " nodes, "
+                + std::to_string(ast.lists.size()) + " list entries, "
+                + std::to_string(ast.nodes.size() * sizeof(Node) + ast.lists.size() * sizeof(NodeIndex))
+                + " bytes";
+        }
+    });
+
+    int status = EXIT_SUCCESS;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (!results[i].diagnostic.empty()) {
+            std::cerr << (inputs.size() > 1 ? inputs[i] + ": " : "") << results[i].diagnostic << std::endl;
+        }
+        if (results[i].failed) {
+            status = EXIT_FAILURE;
+        }
+    }
+    if (time_passes || stats_json) {
+        // only files that compiled; a failed compile stops partway
+        std::vector<FileStats> files;
+        for (size_t i = 0; i < inputs.size(); i++) {
+            if (!results[i].failed) {
+                files.push_back({.input = inputs[i], .stats = std::move(results[i].stats)});
+            }
+        }
+        report_stats(files, time_passes, stats_json, start_ms);
+    }
+    if (cache != nullptr) {
+        cache->finish();
+        if (cache_stats) {
+            std::cerr << "cache: " << cache->stats() << std::endl;
+        }
+    }
+    return status;
+}
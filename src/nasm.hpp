@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <sys/uio.h>
+#include "./output.hpp"
+#include "./runtime.hpp"
+#include "./x86.hpp"
+
+// NASM listing of an Assembly, for --emit-asm. Each section is formatted into its own
+// buffer and the buffers go to the file with one writev. They keep their capacity between
+// compiles, so a long-lived writer stops allocating once it has seen its largest program.
+class NasmWriter {
+public:
+    inline void write(const std::string& path, const Assembly& assembly) {
+        m_data.clear();
+        if (assembly.prints || assembly.target == Target::jit) {
+            m_data += "section .bss\n";
+        }
+        if (assembly.prints) {
+            m_data += "    outbuf resb ";
+            append_int(m_data, print_buffer_size);
+            m_data += "\n    outpos resq 1\n";
+        }
+        if (assembly.target == Target::jit) {
+            m_data += "    host_rsp resq 1\n";
+        }
+        const std::string& strings = assembly.strings;
+        if (!strings.empty()) {
+            m_data += "section .rodata\nstrings:\n";
+            for (size_t i = 0; i < strings.size(); i++) {
+                m_data += i % 32 == 0 ? "    db " : ",";
+                append_int(m_data, static_cast<uint8_t>(strings[i]));
+                if (i % 32 == 31 || i + 1 == strings.size()) {
+                    m_data += "\n";
+                }
+            }
+        }
+        m_text.clear();
+        m_text += "section .text\nglobal _start\n_start:\n";
+        for (const Instr& instr : assembly.instrs) {
+            append_instr(m_text, instr);
+        }
+        iovec parts[] = {output_part(m_data.data(), m_data.size()), output_part(m_text.data(), m_text.size())};
+        write_output(path, parts);
+    }
+
+private:
+    std::string m_data;
+    std::string m_text;
+};
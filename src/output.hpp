@@ -0,0 +1,57 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <fcntl.h>
+#include <span>
+#include <string>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "./error.hpp"
+
+// Writes the concatenation of parts to path with writev, so output kept in separate
+// buffers (file headers, code, data, sections of a listing) never has to be copied into
+// one. The file is replaced rather than truncated, like ld does, so a running copy of an
+// executable isn't disturbed.
+inline void write_output(const std::string& path, std::span<iovec> parts, mode_t mode = 0666) {
+    unlink(path.c_str());
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+    if (fd < 0) {
+        throw CompileError("Unable to write " + path);
+    }
+    bool ok = true;
+    while (true) {
+        while (!parts.empty() && parts.front().iov_len == 0) {
+            parts = parts.subspan(1);
+        }
+        if (parts.empty()) {
+            break;
+        }
+        ssize_t n = writev(fd, parts.data(), static_cast<int>(std::min<size_t>(parts.size(), IOV_MAX)));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = false;
+            break;
+        }
+        // skip what was written, which may end partway through a part
+        auto written = static_cast<size_t>(n);
+        while (!parts.empty() && written >= parts.front().iov_len) {
+            written -= parts.front().iov_len;
+            parts = parts.subspan(1);
+        }
+        if (!parts.empty()) {
+            parts.front().iov_base = static_cast<char*>(parts.front().iov_base) + written;
+            parts.front().iov_len -= written;
+        }
+    }
+    if (close(fd) != 0 || !ok) {
+        throw CompileError("Unable to write " + path);
+    }
+}
+
+inline iovec output_part(const void* data, size_t size) {
+    return {.iov_base = const_cast<void*>(data), .iov_len = size};
+}
@@ -1,331 +1,322 @@
 #pragma once
 #include "./tokenization.hpp"
-#include <variant>
-#include <string>
-struct NodeTermIntLit {
-    Token int_lit;
-};
-struct NodeTermIdentifier {
-    Token ident;
-};
-struct NodeBinExpr;
-struct NodeExpr;
-struct NodeTermParen {
-    NodeExpr* expr;
-};
-struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdentifier*, NodeTermParen*> var;
-};
+#include <charconv>
+#include <span>
+#include <string_view>
 
-struct NodeExpr {
-    std::variant<NodeTerm*, NodeBinExpr*> var;
-};
-struct NodeBinExprAdd {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-struct NodeBinExprSub {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-struct NodeBinExprDiv {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
-struct NodeBinExprMul {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
+// The AST is one contiguous array of fixed-size nodes; children are referenced by their
+// index into it. What lhs/rhs hold depends on the kind.
+enum class NodeKind : uint8_t {
+    // expressions
+    int_lit,    // lhs/rhs: low/high 32 bits of the value
+    ident,      // lhs: symbol
+    add,        // lhs, rhs: operands
+    sub,
+    mul,
+    div,
+    eq,         // lhs, rhs: operands; the value is 1 if the comparison holds, else 0
+    ne,
+    lt,
+    le,
+    gt,
+    ge,
+    // statements
+    exit,       // lhs: expression
+    let,        // lhs: symbol, rhs: expression
+    assign,     // lhs: symbol, rhs: expression
+    print,      // lhs: first entry in Ast::lists, rhs: argument count
+    scope,      // lhs: first entry in Ast::lists, rhs: statement count
+    if_,        // lhs: condition, rhs: scope
+    while_,     // lhs: condition, rhs: scope
+    prog,       // lhs: first entry in Ast::lists, rhs: statement count
 };
 
-struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprMul*, NodeBinExprSub*, NodeBinExprDiv*> var;
-};
+using NodeIndex = uint32_t;
 
-struct NodeStmtExit {
-    NodeExpr* expression;
-};
-struct NodeStmtLet {
-    Token ident;
-    NodeExpr* expr;
-};
-struct NodeStmtPrint {
-    std::vector<NodeExpr*>  expr;
-};
-struct NodeStmt;
+struct Node {
+    NodeKind kind;
+    uint32_t lhs = 0;
+    uint32_t rhs = 0;
 
-struct NodeScope {
-    std::vector<NodeStmt*>  stmts;
-};
-struct NodeStmtIf {
-    NodeExpr* expr;
-    NodeScope* scope;
-};
-struct NodeStmtAssign {
-    Token ident;
-    NodeExpr* expr;
-};
-struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeStmtPrint*, NodeStmtAssign*, NodeScope*, NodeStmtIf*> var;
-};
-struct NodeProg {
-    std::vector<NodeStmt*> stmts;
+    [[nodiscard]] inline int64_t int_value() const {
+        return static_cast<int64_t>(static_cast<uint64_t>(rhs) << 32 | lhs);
+    }
 };
+static_assert(sizeof(Node) == 12);
+
+inline bool is_bin_expr(NodeKind kind) {
+    return kind >= NodeKind::add && kind <= NodeKind::ge;
+}
 
+inline bool is_comparison(NodeKind kind) {
+    return kind >= NodeKind::eq && kind <= NodeKind::ge;
+}
 
+struct Ast {
+    std::vector<Node> nodes;
+    std::vector<NodeIndex> lists;
+    NodeIndex root = 0;
+
+    [[nodiscard]] inline const Node& operator[](NodeIndex index) const {
+        return nodes[index];
+    }
+
+    // Children of a print, scope or prog node.
+    [[nodiscard]] inline std::span<const NodeIndex> children(const Node& node) const {
+        return {lists.data() + node.lhs, node.rhs};
+    }
+
+    // Calls visit(index) for every node of the expression at index, each before its operands
+    // and left operands first, like a recursive walk would. The pending operands are kept in
+    // stack, the caller's scratch vector, so arbitrarily deep expressions don't exhaust the
+    // thread's stack.
+    template<typename Visit>
+    inline void visit_expr(NodeIndex index, std::vector<NodeIndex>& stack, Visit visit) const {
+        size_t base = stack.size();
+        stack.push_back(index);
+        while (stack.size() > base) {
+            NodeIndex next = stack.back();
+            stack.pop_back();
+            visit(next);
+            const Node& node = nodes[next];
+            if (is_bin_expr(node.kind)) {
+                stack.push_back(node.rhs);
+                stack.push_back(node.lhs);
+            }
+        }
+    }
+
+    // Whether evaluating the expression at index can trap: it divides by something that
+    // isn't a constant known to be safe, as division by zero and INT64_MIN / -1 trap.
+    // Passes that drop or reorder an expression have to keep one that can.
+    [[nodiscard]] inline bool can_trap(NodeIndex index, std::vector<NodeIndex>& stack) const {
+        bool trap = false;
+        visit_expr(index, stack, [&](NodeIndex node) {
+            const Node& expr = nodes[node];
+            if (expr.kind == NodeKind::div) {
+                const Node& divisor = nodes[expr.rhs];
+                trap |= divisor.kind != NodeKind::int_lit || divisor.int_value() == 0 || divisor.int_value() == -1;
+            }
+        });
+        return trap;
+    }
+
+    inline NodeIndex add(NodeKind kind, uint32_t lhs = 0, uint32_t rhs = 0) {
+        nodes.push_back({.kind = kind, .lhs = lhs, .rhs = rhs});
+        return static_cast<NodeIndex>(nodes.size() - 1);
+    }
+
+    inline NodeIndex add_int_lit(int64_t value) {
+        auto bits = static_cast<uint64_t>(value);
+        return add(NodeKind::int_lit, static_cast<uint32_t>(bits), static_cast<uint32_t>(bits >> 32));
+    }
+};
 
 class Parser {
 public:
-    inline explicit Parser(std::vector<Token> tokens) : m_tokens(std::move(tokens)),  m_allocator(1024*1024*4) {
+    inline explicit Parser(std::vector<Token> tokens, std::string_view src) : m_tokens(std::move(tokens)), m_src(src) {
+
+    }
+
+    inline explicit Parser(Tokenizer& tokenizer, std::string_view src) : m_tokens(tokenizer), m_src(src) {
+
+    }
 
+    // Starts over on a new input. The AST buffers keep their capacity, so a long-lived
+    // parser stops allocating once it has seen its largest input.
+    inline void reset(Tokenizer& tokenizer, std::string_view src) {
+        m_tokens = TokenStream(tokenizer);
+        m_src = src;
+        m_ast.nodes.clear();
+        m_ast.lists.clear();
+        m_ast.root = 0;
+        m_list_scratch.clear();
+        m_operands.clear();
+        m_operators.clear();
     }
 
-    inline std::optional<NodeTerm*> parse_term() {
+    // A literal or an identifier; parentheses are handled by parse_expr.
+    inline std::optional<NodeIndex> parse_term() {
         if (auto int_lit = try_consume(TokenType::int_lit)) {
-            auto node_term_int_lit = m_allocator.alloc<NodeTermIntLit>();
-            node_term_int_lit->int_lit = int_lit.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var=node_term_int_lit;
-            return term;
+            return m_ast.add_int_lit(parse_int(int_lit.value(), false));
         } else if (auto ident = try_consume(TokenType::ident)) {
-            auto term_ident = m_allocator.alloc<NodeTermIdentifier>();
-            term_ident->ident = ident.value();
-            auto term = m_allocator.alloc<NodeTerm>();
-            term->var = term_ident;
-            return term;
-        }
-        else if (auto open_paren = try_consume(TokenType::open_paren)) {
-            if (auto expr = parse_expr()) {
-                if (auto close_paren = try_consume(TokenType::close_paren)) {
-                    auto term_paren = m_allocator.alloc<NodeTermParen>();
-                    term_paren->expr = expr.value();
-                    auto term = m_allocator.alloc<NodeTerm>();
-                    term->var = term_paren;
-                    return term;
-                } else {
-                    std::cerr << "Expected ')'." << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-            } else {
-                std::cerr << "Expected expression." << std::endl;
-                exit(EXIT_FAILURE);
-            }
+            return m_ast.add(NodeKind::ident, ident.value().sym());
         } else if (auto minus = try_consume(TokenType::minus)) {
-            if (auto int_lit = try_consume(TokenType::int_lit)) {
-                auto node_term_int_lit = m_allocator.alloc<NodeTermIntLit>();
-                int_lit.value().value = "-" + int_lit.value().value.value();
-                node_term_int_lit->int_lit = int_lit.value();
-                auto term = m_allocator.alloc<NodeTerm>();
-                term->var=node_term_int_lit;
-                return term;
-            }
+            auto int_lit = try_consume(TokenType::int_lit, "Expected integer literal after '-'.");
+            return m_ast.add_int_lit(parse_int(int_lit, true));
         } else if (auto apo = try_consume(TokenType::apo)) {
             if (auto lit = try_consume(TokenType::ident)) {
-                if (!lit.value().value.has_value() || lit.value().value.value().length() != 1) {
-                    std::cerr << "Expected a char." << std::endl;
-                    exit(EXIT_FAILURE);
+                if (lit.value().text(m_src).size() != 1) {
+                    throw CompileError("Expected a char.");
                 }
                 try_consume(TokenType::apo, "Expected '.");
-                auto node_char_lit = m_allocator.alloc<NodeTermIntLit>();
-                int val = static_cast<int>(lit.value().value.value().at(0));
-                node_char_lit->int_lit.type = TokenType::int_lit;
-                std::stringstream str;
-                str << val;
-                node_char_lit->int_lit.value = str.str();
-                auto term = m_allocator.alloc<NodeTerm>();
-                term->var=node_char_lit;
-                return term;
+                return m_ast.add_int_lit(static_cast<int>(lit.value().text(m_src).at(0)));
             }
-            if (auto bslash = try_consume(TokenType::bslash)) {
-                if (auto lit = try_consume(TokenType::ident)) {
-                    if (!lit.value().value.has_value() || lit.value().value.value().length() != 1) {
-                        std::cerr << "Expected a char." << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-                    try_consume(TokenType::apo, "Expected '.");
-                    auto node_char_lit = m_allocator.alloc<NodeTermIntLit>();
-                    if (lit.value().value.value() == "n") {
-                        node_char_lit->int_lit.type = TokenType::int_lit;
-                        node_char_lit->int_lit.value = "10";
-                        auto term = m_allocator.alloc<NodeTerm>();
-                        term->var=node_char_lit;
-                        return term;
-                    }
-                    else {
-                        std::cerr << "Unsupported \\." << std::endl;
-                        exit(EXIT_FAILURE);
-                    }
-                }
+            try_consume(TokenType::bslash, "Expected a char.");
+            auto lit = try_consume(TokenType::ident, "Expected a char.");
+            if (lit.text(m_src).size() != 1) {
+                throw CompileError("Expected a char.");
+            }
+            try_consume(TokenType::apo, "Expected '.");
+            if (lit.text(m_src) == "n") {
+                return m_ast.add_int_lit(10);
+            }
+            else {
+                throw CompileError("Unsupported \\.");
             }
         }
-        else {
-            return {};
-        }
+        return {};
     }
 
-    inline std::optional<NodeExpr*> parse_expr(int min_prec = 0) {
-        if (auto term_lhs = parse_term()) {
-            auto expr_lhs = m_allocator.alloc<NodeExpr>();
-            expr_lhs->var = term_lhs.value();
+    // Operator precedence parsing with explicit operand and operator stacks instead of
+    // recursion, so deeply nested parentheses and long operator chains cost heap memory
+    // rather than thread stack. Binary operators are left associative.
+    inline std::optional<NodeIndex> parse_expr() {
+        size_t operands = m_operands.size();
+        size_t operators = m_operators.size();
+        size_t open_parens = 0;
+        bool after_op = false;
+        while (true) {
+            bool after_paren = false;
+            while (try_consume(TokenType::open_paren).has_value()) {
+                m_operators.push_back(TokenType::open_paren);
+                open_parens++;
+                after_paren = true;
+            }
+            auto term = parse_term();
+            if (!term.has_value()) {
+                if (after_paren) {
+                    throw CompileError("Expected expression.");
+                }
+                if (after_op) {
+                    throw CompileError("Unable to parse expression");
+                }
+                return {};
+            }
+            m_operands.push_back(term.value());
+            // closing parentheses, up to the next operator or the end of the expression
             while (true) {
                 auto cur_tok = peak();
-                if ((!cur_tok.has_value()) || !is_bin_op(cur_tok->type) || get_prec(cur_tok->type).value() < min_prec) {
+                if (cur_tok.has_value() && is_bin_op(cur_tok->type)) {
+                    reduce(operators, get_prec(cur_tok->type).value());
+                    m_operators.push_back(consume().type);
                     break;
                 }
-                int prec = get_prec(cur_tok->type).value();
-                int next_min_prec = prec+1;
-                auto op = consume();
-                auto expr_rhs = parse_expr(next_min_prec);
-                if (!expr_rhs.has_value()) {
-                    std::cerr << "Unable to parse expression" << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                auto expr = m_allocator.alloc<NodeBinExpr>();
-                if (op.type == TokenType::plus) {
-                    auto add = m_allocator.alloc<NodeBinExprAdd>();
-                    add->lhs = m_allocator.alloc<NodeExpr>();
-                    add->lhs->var = expr_lhs->var;
-                    add->rhs = expr_rhs.value();
-                    expr->var = add;
-                } else if (op.type == TokenType::star) {
-                    auto multi = m_allocator.alloc<NodeBinExprMul>();
-                    multi->lhs = m_allocator.alloc<NodeExpr>();
-                    multi->lhs->var = expr_lhs->var;
-                    multi->rhs = expr_rhs.value();
-                    expr->var = multi;
-                }
-                else if (op.type == TokenType::minus) {
-                    auto sub = m_allocator.alloc<NodeBinExprSub>();
-                    sub->lhs = m_allocator.alloc<NodeExpr>();
-                    sub->lhs->var = expr_lhs->var;
-                    sub->rhs = expr_rhs.value();
-                    expr->var = sub;
+                if (open_parens == 0) {
+                    reduce(operators, 0);
+                    NodeIndex expr = m_operands.back();
+                    m_operands.resize(operands);
+                    return expr;
                 }
-                else if (op.type == TokenType::slash) {
-                    auto div = m_allocator.alloc<NodeBinExprDiv>();
-                    div->lhs = m_allocator.alloc<NodeExpr>();
-                    div->lhs->var = expr_lhs->var;
-                    div->rhs = expr_rhs.value();
-                    expr->var = div;
+                if (!cur_tok.has_value() || cur_tok->type != TokenType::close_paren) {
+                    throw CompileError("Expected ')'.");
                 }
-                expr_lhs->var = expr;
+                consume();
+                reduce(operators, 0);
+                m_operators.pop_back();
+                open_parens--;
             }
-            return expr_lhs;
+            after_op = true;
+        }
+    }
+
+    // Applies the operators on top of the stack, down to the innermost open parenthesis or
+    // the first operator of the expression (at first), that bind at least as tightly as
+    // min_prec.
+    inline void reduce(size_t first, int min_prec) {
+        while (m_operators.size() > first && m_operators.back() != TokenType::open_paren
+               && get_prec(m_operators.back()).value() >= min_prec) {
+            NodeIndex rhs = m_operands.back();
+            m_operands.pop_back();
+            NodeIndex lhs = m_operands.back();
+            m_operands.back() = m_ast.add(bin_expr_kind(m_operators.back()), lhs, rhs);
+            m_operators.pop_back();
         }
-        return {};
     }
-    std::optional<NodeScope*> parse_scope() {
+
+    std::optional<NodeIndex> parse_scope() {
         if (!try_consume(TokenType::open_curly).has_value()) {
             return {};
         }
-        auto scope = m_allocator.alloc<NodeScope>();
+        size_t first = m_list_scratch.size();
         while (auto stmt = parse_stmt()) {
-            scope->stmts.push_back(stmt.value());
+            m_list_scratch.push_back(stmt.value());
         }
         try_consume(TokenType::close_curly, "Expected '}'");
-        return scope;
+        return add_list_node(NodeKind::scope, first);
     }
-    std::optional<NodeStmt*> parse_stmt() {
+    std::optional<NodeIndex> parse_stmt() {
         if (peak().has_value() && peak().value().type == TokenType::exit &&
             peak(1).has_value() && peak(1).value().type == TokenType::open_paren) {
             consume();
             consume();
-            NodeStmtExit* stmt_exit;
+            NodeIndex stmt_exit;
             if (auto node_expr = parse_expr()) {
-                stmt_exit = m_allocator.alloc<NodeStmtExit>();
-                stmt_exit->expression = node_expr.value();
+                stmt_exit = m_ast.add(NodeKind::exit, node_expr.value());
             } else {
-                std::cerr << "Invalid expression" << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid expression");
             }
             try_consume(TokenType::close_paren, "Expected ')'");
             try_consume(TokenType::semi, "Expected ';'");
-            auto node_stmt = m_allocator.alloc<NodeStmt>();
-            node_stmt->var = stmt_exit;
-            return node_stmt;
+            return stmt_exit;
         }
         else if (try_consume(TokenType::let).has_value()) {
                 if (auto ident = try_consume(TokenType::ident)) {
-                    auto stmt = m_allocator.alloc<NodeStmtLet>();
-                    stmt->ident=ident.value(); //ident
                     try_consume(TokenType::eq, "Expected '='");
                     if (auto expr = parse_expr()) { //expr
-                        stmt->expr = expr.value();
                         try_consume(TokenType::semi, "Expected ';'");
-                        auto node_stmt = m_allocator.alloc<NodeStmt>();
-                        node_stmt->var = stmt;
-                        return node_stmt;
+                        return m_ast.add(NodeKind::let, ident.value().sym(), expr.value());
                     } else {
-                        std::cerr << "Invalid expression." << std::endl;
-                        exit(EXIT_FAILURE);
+                        throw CompileError("Invalid expression.");
                     }
             }
         } else if (try_consume(TokenType::print).has_value()) {
-            auto stmt_print = m_allocator.alloc<NodeStmtPrint>();
             if (!try_consume(TokenType::open_paren).has_value()) {
-                std::cerr << "Expected '('"<<std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Expected '('");
             }
+            size_t first = m_list_scratch.size();
             if (auto print_expr = parse_expr()) {
-                stmt_print->expr.push_back(print_expr.value());
+                m_list_scratch.push_back(print_expr.value());
                 while (try_consume(TokenType::comma).has_value()) {
                     if ((print_expr = parse_expr()).has_value()) {
-                        stmt_print->expr.push_back(print_expr.value());
+                        m_list_scratch.push_back(print_expr.value());
                     } else {
-                        std::cerr << "Expected expression"<<std::endl;
-                        exit(EXIT_FAILURE);
+                        throw CompileError("Expected expression");
                     }
                 }
                 if (!try_consume(TokenType::close_paren).has_value()) {
-                    std::cerr << "Expected ')'"<<std::endl;
-                    exit(EXIT_FAILURE);
+                    throw CompileError("Expected ')'");
                 }
                 if (!try_consume(TokenType::semi).has_value()) {
-                    std::cerr << "Expected ';'"<<std::endl;
-                    exit(EXIT_FAILURE);
+                    throw CompileError("Expected ';'");
                 }
-                auto stmt = m_allocator.alloc<NodeStmt>();
-                stmt->var = stmt_print;
-                return stmt;
+                return add_list_node(NodeKind::print, first);
             } else {
-                std::cerr << "Expected expression"<<std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Expected expression");
             }
         } else if (auto ident = try_consume(TokenType::ident)) {
             try_consume(TokenType::eq, "Expected '='.");
-            auto stmt_assign = m_allocator.alloc<NodeStmtAssign>();
-            stmt_assign->ident = ident.value();
             if (auto expr = parse_expr()) {
-                stmt_assign->expr = expr.value();
-                auto stmt = m_allocator.alloc<NodeStmt>();
-                stmt->var = stmt_assign;
                 try_consume(TokenType::semi, "Expected ';'.");
-                return stmt;
+                return m_ast.add(NodeKind::assign, ident.value().sym(), expr.value());
             } else {
-                std::cerr<<"Expected expression."<<std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Expected expression.");
             }
         } else if (auto scope = parse_scope()) {
-            auto stmt = m_allocator.alloc<NodeStmt>();
-            stmt->var = scope.value();
-            return stmt;
-        } else if (auto if_ = try_consume(TokenType::if_)) {
+            return scope.value();
+        } else if (peak().has_value() && (peak().value().type == TokenType::if_ || peak().value().type == TokenType::while_)) {
+            // if and while only differ in what the generators make of them
+            NodeKind kind = consume().type == TokenType::if_ ? NodeKind::if_ : NodeKind::while_;
             try_consume(TokenType::open_paren, "Expected '('");
-            auto stmt_if = m_allocator.alloc<NodeStmtIf>();
             if (auto expr = parse_expr()) {
-                stmt_if->expr = expr.value();
                 try_consume(TokenType::close_paren, "Expected ')'");
                 if (auto scope = parse_scope()) {
-                    stmt_if->scope = scope.value();
-                    auto stmt = m_allocator.alloc<NodeStmt>();
-                    stmt->var = stmt_if;
-                    return stmt;
+                    return m_ast.add(kind, expr.value(), scope.value());
                 } else {
-                    std::cerr << "Invalid scope." << std::endl;
-                    exit(EXIT_FAILURE);
+                    throw CompileError("Invalid scope.");
                 }
             } else {
-                std::cerr << "Invalid expression." << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid expression.");
             }
         }
         return {};
@@ -333,40 +324,87 @@ public:
 
 
 
-    inline std::optional<NodeProg> parse_prog() {
-        NodeProg prog;
+    [[nodiscard]] inline const Ast& ast() const {
+        return m_ast;
+    }
+
+    // Tokens the last parse read.
+    [[nodiscard]] inline size_t token_count() const {
+        return m_tokens.token_count();
+    }
+
+    inline Ast& parse_prog() {
         while (peak().has_value()) {
             if (auto stmt = parse_stmt()) {
-                prog.stmts.push_back(stmt.value());
+                m_list_scratch.push_back(stmt.value());
             } else {
-                std::cerr << "Invalid statement." << std::endl;
-                exit(EXIT_FAILURE);
+                throw CompileError("Invalid statement.");
             }
         }
-        return prog;
+        m_ast.root = add_list_node(NodeKind::prog, 0);
+        return m_ast;
     }
 
 
 private:
-    [[nodiscard]] inline std::optional<Token> peak(int offset = 0) const {
-        if (m_index + offset >= m_tokens.size()) {
-            return {};
+    static inline NodeKind bin_expr_kind(TokenType type) {
+        switch (type) {
+            case TokenType::plus:
+                return NodeKind::add;
+            case TokenType::minus:
+                return NodeKind::sub;
+            case TokenType::star:
+                return NodeKind::mul;
+            case TokenType::eq_eq:
+                return NodeKind::eq;
+            case TokenType::bang_eq:
+                return NodeKind::ne;
+            case TokenType::lt:
+                return NodeKind::lt;
+            case TokenType::lt_eq:
+                return NodeKind::le;
+            case TokenType::gt:
+                return NodeKind::gt;
+            case TokenType::gt_eq:
+                return NodeKind::ge;
+            default:
+                return NodeKind::div;
         }
-        else {
-            return m_tokens.at(m_index + offset);
+    }
+
+    // Moves the children collected in m_list_scratch since `first` into one contiguous run
+    // of Ast::lists, so nested scopes can collect their own children in the meantime.
+    inline NodeIndex add_list_node(NodeKind kind, size_t first) {
+        auto begin = static_cast<uint32_t>(m_ast.lists.size());
+        auto count = static_cast<uint32_t>(m_list_scratch.size() - first);
+        m_ast.lists.insert(m_ast.lists.end(), m_list_scratch.begin() + first, m_list_scratch.end());
+        m_list_scratch.resize(first);
+        return m_ast.add(kind, begin, count);
+    }
+
+    [[nodiscard]] inline int64_t parse_int(const Token& int_lit, bool negative) const {
+        std::string_view digits = int_lit.text(m_src);
+        uint64_t magnitude = 0;
+        auto [end, ec] = std::from_chars(digits.data(), digits.data() + digits.size(), magnitude);
+        if (ec != std::errc() || magnitude > static_cast<uint64_t>(INT64_MAX) + negative) {
+            throw CompileError("Integer literal out of range: " + std::string(negative ? "-" : "") + std::string(digits));
         }
+        return negative ? static_cast<int64_t>(0 - magnitude) : static_cast<int64_t>(magnitude);
+    }
+
+    [[nodiscard]] inline std::optional<Token> peak(int offset = 0) {
+        return m_tokens.peek(offset);
     }
 
     inline Token consume() {
-        return m_tokens.at(m_index++);
+        return m_tokens.consume();
     }
 
     inline Token try_consume(TokenType type, const std::string& err_msg) {
         if (peak().has_value() && peak().value().type == type) {
             return consume();
         } else {
-            std::cerr<<err_msg<<std::endl;
-            exit(EXIT_FAILURE);
+            throw CompileError(err_msg);
         }
     }
     inline std::optional<Token> try_consume(TokenType type) {
@@ -376,7 +414,11 @@ private:
             return {};
         }
     }
-    const std::vector<Token> m_tokens;
-    size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    TokenStream m_tokens;
+    std::string_view m_src;
+    Ast m_ast;
+    std::vector<NodeIndex> m_list_scratch;
+    // parse_expr's stacks; open parentheses are kept among the operators
+    std::vector<NodeIndex> m_operands;
+    std::vector<TokenType> m_operators;
 };
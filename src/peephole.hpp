@@ -0,0 +1,524 @@
+#pragma once
+
+#include <vector>
+#include "./x86.hpp"
+
+// Peephole pass over the generated instruction list, run at -O1. Rewrites, each only ever
+// removing instructions:
+//  - `push x` ... `pop r` with nothing touching rsp or r in between becomes `mov r, x`,
+//  - `add rsp, a` / `add rsp, b` merge and `add rsp, 0` disappears,
+//  - writes to registers that are never read again are removed, and a register that is
+//    loaded only to be used once is replaced by what it was loaded from,
+//  - `mov t, x` / `op t, y` / `mov z, t` computes in z directly,
+//  - `op r, y` / `test r, r` / `jz` drops the test, and `mov t, x` / `sub t, y` / `jz`
+//    becomes `cmp x, y` / `jz`; the same goes for `jnz`.
+// Instructions are processed back to front with register liveness, so every rewrite
+// sees the already simplified code after it. Sweeps repeat until nothing changes.
+class PeepholeOptimizer {
+public:
+    inline PeepholeOptimizer(std::vector<Instr>& instrs, uint32_t label_count)
+        : m_instrs(instrs), m_label_live(label_count) {
+    }
+
+    inline void run() {
+        while (sweep()) {
+        }
+    }
+
+private:
+    // One bit per Reg, plus one for the flags.
+    using RegSet = uint32_t;
+    static constexpr RegSet flags = 1u << 16;
+
+    struct Entry {
+        Instr instr;
+        RegSet live_in;
+        RegSet live_out;
+    };
+
+    static inline RegSet bit(Reg reg) {
+        return 1u << static_cast<uint8_t>(reg);
+    }
+
+    // Registers read to compute the operand's value or address.
+    static inline RegSet operand_reads(const Operand& operand) {
+        if (operand.kind == Operand::Kind::reg) {
+            return bit(operand.reg);
+        }
+        if (operand.kind != Operand::Kind::mem || !operand.sym.empty()) {
+            return 0;
+        }
+        return bit(operand.reg) | (operand.scale != 0 ? bit(operand.index) : 0);
+    }
+
+    // Registers read to compute the operand's address, when it is written to.
+    static inline RegSet address_reads(const Operand& operand) {
+        return operand.kind == Operand::Kind::mem ? operand_reads(operand) : 0;
+    }
+
+    static inline RegSet dest_writes(const Operand& operand) {
+        return operand.kind == Operand::Kind::reg ? bit(operand.reg) : 0;
+    }
+
+    static inline RegSet reads(const Instr& instr) {
+        switch (instr.op) {
+            case Op::mov:
+                // writing the low byte keeps the rest of the register
+                return operand_reads(instr.b) | address_reads(instr.a)
+                    | (instr.a.kind == Operand::Kind::reg && instr.a.size < 4 ? bit(instr.a.reg) : 0);
+            case Op::lea:
+                return operand_reads(instr.b);
+            case Op::movzx:
+                return operand_reads(instr.b);
+            case Op::sete:
+            case Op::setne:
+            case Op::setl:
+            case Op::setge:
+            case Op::setle:
+            case Op::setg:
+                // writing the low byte keeps the rest of the register
+                return flags | operand_reads(instr.a);
+            case Op::push:
+                return operand_reads(instr.a) | bit(Reg::rsp);
+            case Op::pop:
+                return address_reads(instr.a) | bit(Reg::rsp);
+            case Op::xor_:
+                if (instr.a == instr.b) {
+                    return 0;
+                }
+                return operand_reads(instr.a) | operand_reads(instr.b);
+            case Op::add:
+            case Op::sub:
+            case Op::cmp:
+            case Op::test:
+            case Op::neg:
+            case Op::shl:
+            case Op::sar:
+            case Op::shr:
+                return operand_reads(instr.a) | operand_reads(instr.b);
+            case Op::imul:
+                if (instr.b.kind == Operand::Kind::none) {
+                    return operand_reads(instr.a) | bit(Reg::rax);
+                }
+                if (instr.c.kind != Operand::Kind::none) {
+                    return operand_reads(instr.b);
+                }
+                return operand_reads(instr.a) | operand_reads(instr.b);
+            case Op::mul:
+                return operand_reads(instr.a) | bit(Reg::rax);
+            case Op::div:
+            case Op::idiv:
+                return operand_reads(instr.a) | bit(Reg::rax) | bit(Reg::rdx);
+            case Op::cqo:
+                return bit(Reg::rax);
+            case Op::jz:
+            case Op::jnz:
+            case Op::jl:
+            case Op::jge:
+            case Op::jle:
+            case Op::jg:
+                return flags;
+            case Op::call:
+                // the runtime routines take their arguments in rax, or rcx and rsi
+                if (instr.a.sym == "pigeon_putc") {
+                    return bit(Reg::rax) | bit(Reg::rsp);
+                }
+                if (instr.a.sym == "pigeon_puts") {
+                    return bit(Reg::rcx) | bit(Reg::rsi) | bit(Reg::rsp);
+                }
+                if (instr.a.sym == "pigeon_flush") {
+                    return bit(Reg::rsp);
+                }
+                return bit(Reg::rax) | bit(Reg::rcx) | bit(Reg::rsi) | bit(Reg::rsp);
+            case Op::syscall:
+                return bit(Reg::rax) | bit(Reg::rdi) | bit(Reg::rsi) | bit(Reg::rdx)
+                    | bit(Reg::r10) | bit(Reg::r8) | bit(Reg::r9);
+            case Op::rep_movsb:
+                return bit(Reg::rcx) | bit(Reg::rsi) | bit(Reg::rdi);
+            default:
+                return 0;
+        }
+    }
+
+    static inline RegSet writes(const Instr& instr) {
+        switch (instr.op) {
+            case Op::mov:
+            case Op::movzx:
+            case Op::lea:
+            case Op::sete:
+            case Op::setne:
+            case Op::setl:
+            case Op::setge:
+            case Op::setle:
+            case Op::setg:
+                return dest_writes(instr.a);
+            case Op::push:
+                return bit(Reg::rsp);
+            case Op::pop:
+                return dest_writes(instr.a) | bit(Reg::rsp);
+            case Op::imul:
+                if (instr.b.kind == Operand::Kind::none) {
+                    return bit(Reg::rax) | bit(Reg::rdx) | flags;
+                }
+                return dest_writes(instr.a) | flags;
+            case Op::add:
+            case Op::sub:
+            case Op::xor_:
+            case Op::neg:
+            case Op::shl:
+            case Op::sar:
+            case Op::shr:
+                return dest_writes(instr.a) | flags;
+            case Op::cmp:
+            case Op::test:
+            case Op::call:
+                return flags;
+            case Op::mul:
+            case Op::div:
+            case Op::idiv:
+                return bit(Reg::rax) | bit(Reg::rdx) | flags;
+            case Op::cqo:
+                return bit(Reg::rdx);
+            case Op::syscall:
+                return bit(Reg::rax) | bit(Reg::rcx) | bit(Reg::r11) | flags;
+            case Op::rep_movsb:
+                return bit(Reg::rcx) | bit(Reg::rsi) | bit(Reg::rdi);
+            default:
+                return 0;
+        }
+    }
+
+    // Instructions whose only effect is on registers and flags.
+    static inline bool is_pure(const Instr& instr) {
+        switch (instr.op) {
+            case Op::mov:
+            case Op::movzx:
+            case Op::lea:
+            case Op::sete:
+            case Op::setne:
+            case Op::setl:
+            case Op::setge:
+            case Op::setle:
+            case Op::setg:
+            case Op::add:
+            case Op::sub:
+            case Op::xor_:
+            case Op::imul:
+            case Op::neg:
+            case Op::shl:
+            case Op::sar:
+            case Op::shr:
+                return instr.a.kind == Operand::Kind::reg && instr.a.reg != Reg::rsp;
+            case Op::cmp:
+            case Op::test:
+            case Op::cqo:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Ops of the form `op r, y` (or `op r`) that read and write r and nothing else.
+    static inline bool is_read_modify_write(const Instr& instr) {
+        switch (instr.op) {
+            case Op::add:
+            case Op::sub:
+            case Op::xor_:
+            case Op::neg:
+            case Op::shl:
+            case Op::sar:
+            case Op::shr:
+                return true;
+            case Op::imul:
+                return instr.b.kind != Operand::Kind::none && instr.c.kind == Operand::Kind::none;
+            default:
+                return false;
+        }
+    }
+
+    static inline bool is_reg64(const Operand& operand) {
+        return operand.kind == Operand::Kind::reg && operand.size == 8;
+    }
+
+    // Can `op dst, source` be encoded (dst is none for single-operand ops)?
+    static inline bool encodable(Op op, const Operand& dst, const Operand& source) {
+        switch (source.kind) {
+            case Operand::Kind::reg:
+                return source.size == 8;
+            case Operand::Kind::imm:
+                if (op == Op::mov && dst.kind == Operand::Kind::reg) {
+                    return true;
+                }
+                return fits_imm32(source.value) && op != Op::imul && op != Op::div && op != Op::idiv;
+            case Operand::Kind::mem:
+                return source.size == 8 && dst.kind != Operand::Kind::mem;
+            case Operand::Kind::sym:
+                return op == Op::mov && dst.kind == Operand::Kind::reg;
+            default:
+                return false;
+        }
+    }
+
+    static inline bool is_conditional_jump(Op op) {
+        return op >= Op::jz && op <= Op::jg;
+    }
+
+    // Jumps that only look at the zero flag.
+    static inline bool is_zero_jump(Op op) {
+        return op == Op::jz || op == Op::jnz;
+    }
+
+    static inline RegSet transfer(const Instr& instr, RegSet live_out) {
+        return (live_out & ~writes(instr)) | reads(instr);
+    }
+
+    // Registers live at the target of a jump. The only jump out of the generated code is
+    // to pigeon_exit (runtime.hpp), which takes the exit code in rdi.
+    inline RegSet target_live(const Operand& target) const {
+        if (target.kind == Operand::Kind::label) {
+            return m_label_live[target.value];
+        }
+        return end_live | bit(Reg::rdi);
+    }
+
+    // Registers live after instruction k of m_out, given what follows it.
+    inline RegSet live_after(size_t k, const Instr& instr) const {
+        if (instr.op == Op::jmp) {
+            return target_live(instr.a);
+        }
+        RegSet live = k == 0 ? end_live : m_out[k - 1].live_in;
+        if (is_conditional_jump(instr.op)) {
+            live |= target_live(instr.a);
+        }
+        return live;
+    }
+
+    // Liveness at each label, iterated to a fixed point so backward jumps are covered.
+    inline void compute_label_liveness() {
+        std::fill(m_label_live.begin(), m_label_live.end(), 0);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            RegSet live = end_live;
+            for (size_t i = m_instrs.size(); i-- > 0;) {
+                const Instr& instr = m_instrs[i];
+                if (instr.op == Op::label) {
+                    RegSet& label = m_label_live[instr.a.value];
+                    changed |= (label | live) != label;
+                    label |= live;
+                } else if (is_conditional_jump(instr.op)) {
+                    live |= target_live(instr.a);
+                } else if (instr.op == Op::jmp) {
+                    live = target_live(instr.a);
+                }
+                live = transfer(instr, live);
+            }
+        }
+    }
+
+    // Recomputes liveness of m_out[from] and everything before it.
+    inline void relive(size_t from) {
+        for (size_t k = from; k < m_out.size(); k++) {
+            Entry& entry = m_out[k];
+            entry.live_out = live_after(k, entry.instr);
+            entry.live_in = transfer(entry.instr, entry.live_out);
+        }
+    }
+
+    inline bool sweep() {
+        compute_label_liveness();
+        m_out.clear();
+        bool changed = false;
+        for (size_t i = m_instrs.size(); i-- > 0;) {
+            changed |= place(m_instrs[i]);
+        }
+        m_instrs.clear();
+        for (auto entry = m_out.rbegin(); entry != m_out.rend(); ++entry) {
+            m_instrs.push_back(entry->instr);
+        }
+        return changed;
+    }
+
+    // Adds cur in front of the already processed instructions, simplifying it and its
+    // successors first. Returns whether anything changed.
+    inline bool place(Instr cur) {
+        bool changed = false;
+        while (true) {
+            RegSet live_out = live_after(m_out.size(), cur);
+            switch (simplify(cur, live_out)) {
+                case Result::removed:
+                    return true;
+                case Result::changed:
+                    changed = true;
+                    continue;
+                case Result::kept:
+                    break;
+            }
+            m_out.push_back({.instr = cur, .live_in = transfer(cur, live_out), .live_out = live_out});
+            return changed;
+        }
+    }
+
+    enum class Result { kept, changed, removed };
+
+    inline Result simplify(Instr& cur, RegSet live_out) {
+        if (cur.op == Op::mov && cur.a == cur.b) {
+            return Result::removed;
+        }
+        if ((cur.op == Op::add || cur.op == Op::sub) && cur.b == imm_operand(0) && !(live_out & flags)) {
+            return Result::removed;
+        }
+        if (is_pure(cur) && !(writes(cur) & live_out)) {
+            return Result::removed;
+        }
+        if (cur.op == Op::push) {
+            return forward_push(cur);
+        }
+        if (m_out.empty()) {
+            return Result::kept;
+        }
+        Entry& n1 = m_out.back();
+        if (cur.op == Op::add && cur.a.is_reg(Reg::rsp) && cur.b.kind == Operand::Kind::imm
+            && n1.instr.op == Op::add && n1.instr.a.is_reg(Reg::rsp) && n1.instr.b.kind == Operand::Kind::imm
+            && fits_imm32(cur.b.value + n1.instr.b.value)) {
+            n1.instr.b.value += cur.b.value;
+            return Result::removed;
+        }
+        if ((cur.op == Op::add || cur.op == Op::sub || cur.op == Op::xor_) && is_reg64(cur.a)
+            && n1.instr.op == Op::test && n1.instr.a == cur.a && n1.instr.b == cur.a
+            && m_out.size() >= 2 && is_zero_jump(m_out[m_out.size() - 2].instr.op)) {
+            // the flags of the operation already say whether the result is zero
+            m_out.pop_back();
+            relive(m_out.size() - 1);
+            return Result::changed;
+        }
+        if (cur.op == Op::mov && is_reg64(cur.a)) {
+            return forward_mov(cur);
+        }
+        return Result::kept;
+    }
+
+    // push x ... pop r  =>  mov r, x ...
+    inline Result forward_push(Instr& cur) {
+        for (size_t k = m_out.size(); k-- > 0;) {
+            const Instr& instr = m_out[k].instr;
+            if (instr.op == Op::label || is_conditional_jump(instr.op) || instr.op == Op::jmp) {
+                return Result::kept;
+            }
+            if (!((reads(instr) | writes(instr)) & bit(Reg::rsp))) {
+                continue;
+            }
+            if (instr.op != Op::pop || !is_reg64(instr.a)) {
+                return Result::kept;
+            }
+            Operand dst = instr.a;
+            for (size_t j = k + 1; j < m_out.size(); j++) {
+                if ((reads(m_out[j].instr) | writes(m_out[j].instr)) & bit(dst.reg)) {
+                    return Result::kept;
+                }
+            }
+            m_out.erase(m_out.begin() + static_cast<ptrdiff_t>(k));
+            relive(k);
+            if (cur.a == dst) {
+                return Result::removed;
+            }
+            cur = {.op = Op::mov, .a = dst, .b = cur.a};
+            return Result::changed;
+        }
+        return Result::kept;
+    }
+
+    // Rewrites around `mov t, x` where t is a register that dies soon after.
+    inline Result forward_mov(Instr& cur) {
+        Operand temp = cur.a;
+        Operand source = cur.b;
+        Entry& n1 = m_out.back();
+        Instr& next = n1.instr;
+        Entry* n2 = m_out.size() >= 2 ? &m_out[m_out.size() - 2] : nullptr;
+
+        // mov t, x / sub t, y / jz  =>  cmp x, y / jz
+        if (next.op == Op::sub && next.a == temp && !next.b.mentions(temp.reg) && n2 != nullptr
+            && is_zero_jump(n2->instr.op) && !(n1.live_out & bit(temp.reg))
+            && (is_reg64(source) || (source.kind == Operand::Kind::mem && next.b.kind != Operand::Kind::mem))) {
+            next = {.op = Op::cmp, .a = source, .b = next.b};
+            relive(m_out.size() - 1);
+            return Result::removed;
+        }
+
+        // mov t, x / op t, y / mov z, t  =>  mov z, x / op z, y
+        bool two_operand = is_read_modify_write(next) && next.a == temp && !next.b.mentions(temp.reg);
+        bool three_operand = next.op == Op::imul && next.c.kind == Operand::Kind::imm && next.a == temp && next.b == temp;
+        if ((two_operand || three_operand) && n2 != nullptr && n2->instr.op == Op::mov && is_reg64(n2->instr.a)
+            && n2->instr.b == temp && !n2->instr.a.is_reg(Reg::rsp) && !(n2->live_out & bit(temp.reg))
+            && !(two_operand && next.b.mentions(n2->instr.a.reg))) {
+            Operand dst = n2->instr.a;
+            next.a = dst;
+            if (three_operand) {
+                next.b = dst;
+            }
+            m_out.erase(m_out.end() - 2);
+            relive(m_out.size() - 1);
+            cur = {.op = Op::mov, .a = dst, .b = source};
+            return Result::changed;
+        }
+
+        // mov t, x / op ..., t  =>  op ..., x
+        if (n1.live_out & bit(temp.reg)) {
+            return Result::kept;
+        }
+        switch (next.op) {
+            case Op::mov:
+            case Op::add:
+            case Op::sub:
+            case Op::cmp:
+                if (next.b == temp && !next.a.mentions(temp.reg) && encodable(next.op, next.a, source)) {
+                    next.b = source;
+                    break;
+                }
+                if (next.op == Op::cmp && next.a == temp && !next.b.mentions(temp.reg)
+                    && (is_reg64(source) || (source.kind == Operand::Kind::mem && next.b.kind != Operand::Kind::mem))) {
+                    next.a = source;
+                    break;
+                }
+                return Result::kept;
+            case Op::imul:
+                if (next.c.kind == Operand::Kind::none && next.b == temp && !next.a.mentions(temp.reg)
+                    && encodable(next.op, next.a, source)) {
+                    next.b = source;
+                    break;
+                }
+                if (next.c.kind != Operand::Kind::none && next.b == temp
+                    && (is_reg64(source) || (source.kind == Operand::Kind::mem && source.size == 8))) {
+                    next.b = source;
+                    break;
+                }
+                return Result::kept;
+            case Op::push:
+            case Op::div:
+            case Op::idiv:
+                if (next.a == temp && encodable(next.op, {}, source)) {
+                    next.a = source;
+                    break;
+                }
+                return Result::kept;
+            case Op::test:
+                if (next.a == temp && next.b == temp && is_reg64(source)) {
+                    next.a = source;
+                    next.b = source;
+                    break;
+                }
+                return Result::kept;
+            default:
+                return Result::kept;
+        }
+        relive(m_out.size() - 1);
+        return Result::removed;
+    }
+
+    static constexpr RegSet end_live = 1u << static_cast<uint8_t>(Reg::rsp);
+
+    std::vector<Instr>& m_instrs;
+    std::vector<RegSet> m_label_live;
+    // Processed instructions, last one first.
+    std::vector<Entry> m_out;
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+#include "./parser.hpp"
+#include "./x86.hpp"
+
+// Linear-scan allocation of `let` variables to the callee-saved registers in local_regs,
+// used at -O1. A variable's live interval runs from its `let` to the end of the enclosing
+// scope and its weight is the number of times it is read or assigned, a use inside a loop
+// counting loop_weight times as much per level of nesting. When more intervals are live
+// than there are registers, the lightest one is spilled: it stays in its stack slot for
+// its whole lifetime, exactly as at -O0.
+class LocalRegisterAllocator {
+public:
+    inline explicit LocalRegisterAllocator(const Ast& ast) : m_ast(ast) {
+    }
+
+    // Maps each register-allocated `let` node to its register. Lets that aren't in the
+    // map live on the stack.
+    inline std::unordered_map<NodeIndex, Reg> allocate() {
+        collect_stmts(m_ast.children(m_ast[m_ast.root]));
+        close_scope(0);
+
+        std::unordered_map<NodeIndex, Reg> assigned;
+        std::vector<Reg> free_regs(std::rbegin(local_regs), std::rend(local_regs));
+        std::vector<size_t> active;
+        for (size_t i = 0; i < m_intervals.size(); i++) {
+            Interval& cur = m_intervals[i];
+            // expire intervals that ended before this one starts
+            std::erase_if(active, [&](size_t a) {
+                if (m_intervals[a].end < cur.start) {
+                    free_regs.push_back(assigned.at(m_intervals[a].let));
+                    return true;
+                }
+                return false;
+            });
+            if (!free_regs.empty()) {
+                assigned[cur.let] = free_regs.back();
+                free_regs.pop_back();
+                active.push_back(i);
+                continue;
+            }
+            auto lightest = std::min_element(active.begin(), active.end(), [&](size_t a, size_t b) {
+                return m_intervals[a].weight < m_intervals[b].weight;
+            });
+            if (lightest != active.end() && m_intervals[*lightest].weight < cur.weight) {
+                Interval& spilled = m_intervals[*lightest];
+                assigned[cur.let] = assigned.at(spilled.let);
+                assigned.erase(spilled.let);
+                *lightest = i;
+            }
+        }
+        return assigned;
+    }
+
+private:
+    static constexpr size_t open = SIZE_MAX;
+    static constexpr size_t loop_weight = 8;
+    static constexpr size_t max_use_weight = size_t{1} << 24;
+
+    struct Interval {
+        NodeIndex let;
+        size_t start;
+        size_t end;
+        size_t weight;
+    };
+
+    inline void collect_stmts(std::span<const NodeIndex> stmts) {
+        for (NodeIndex index : stmts) {
+            collect_stmt(m_ast[index], index);
+        }
+    }
+
+    inline void collect_stmt(const Node& stmt, NodeIndex index) {
+        m_pos++;
+        switch (stmt.kind) {
+            case NodeKind::let:
+                collect_expr(stmt.rhs);
+                m_vars.declare(stmt.lhs, m_intervals.size());
+                m_intervals.push_back({.let = index, .start = m_pos, .end = open, .weight = 0});
+                break;
+            case NodeKind::assign:
+                use(stmt.lhs);
+                collect_expr(stmt.rhs);
+                break;
+            case NodeKind::exit:
+                collect_expr(stmt.lhs);
+                break;
+            case NodeKind::print:
+                for (NodeIndex expr : m_ast.children(stmt)) {
+                    collect_expr(expr);
+                }
+                break;
+            case NodeKind::scope:
+                collect_scope(stmt);
+                break;
+            case NodeKind::if_:
+                collect_expr(stmt.lhs);
+                collect_scope(m_ast[stmt.rhs]);
+                break;
+            case NodeKind::while_: {
+                size_t weight = m_use_weight;
+                m_use_weight = std::min(m_use_weight * loop_weight, max_use_weight);
+                collect_expr(stmt.lhs);
+                collect_scope(m_ast[stmt.rhs]);
+                m_use_weight = weight;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    inline void collect_scope(const Node& scope) {
+        size_t first = m_intervals.size();
+        m_vars.begin_scope();
+        collect_stmts(m_ast.children(scope));
+        m_vars.end_scope();
+        close_scope(first);
+    }
+
+    // Intervals opened since `first` and still open end here.
+    inline void close_scope(size_t first) {
+        for (size_t i = first; i < m_intervals.size(); i++) {
+            if (m_intervals[i].end == open) {
+                m_intervals[i].end = m_pos;
+            }
+        }
+    }
+
+    inline void collect_expr(NodeIndex index) {
+        m_ast.visit_expr(index, m_stack, [&](NodeIndex node) {
+            if (m_ast[node].kind == NodeKind::ident) {
+                use(m_ast[node].lhs);
+            }
+        });
+    }
+
+    inline void use(SymbolId sym) {
+        if (const size_t* interval = m_vars.lookup(sym)) {
+            m_intervals[*interval].weight += m_use_weight;
+        }
+    }
+
+    const Ast& m_ast;
+    std::vector<Interval> m_intervals;
+    ScopedSymbolTable<size_t> m_vars;
+    size_t m_pos = 0;
+    size_t m_use_weight = 1;
+    std::vector<NodeIndex> m_stack;
+};
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <vector>
+#include "./x86.hpp"
+
+// Output runtime of programs that print. Printed bytes collect in a 4 KiB buffer in .bss
+// that is written out when it fills up and before the program exits, so output costs one
+// write syscall per 4 KiB rather than one per character. Runs of constant characters are
+// stored in a .rodata string table and appended with a single call.
+//
+// The routines are appended after the program's code and preserve every register except
+// the flags, so calling them doesn't disturb register allocation:
+//   pigeon_putc   appends the low byte of rax
+//   pigeon_puts   appends rcx bytes from rsi (rcx > 0)
+//   pigeon_flush  writes out the buffer
+//
+// Code generated for --run executes inside the compiler's process, where the exit syscall
+// would end the compiler too. It is entered through pigeon_enter and leaves through
+// pigeon_exit instead, which return to the caller like a function (jit.hpp):
+//   pigeon_enter  saves the caller's callee-saved registers and stack pointer (in
+//                 host_rsp) and jumps to the program at rdi
+//   pigeon_exit   flushes, restores them and returns the exit code in rdi
+inline constexpr int64_t print_buffer_size = 4096;
+
+inline void append_print_char(std::vector<Instr>& instrs) {
+    instrs.push_back({.op = Op::call, .a = sym_operand("pigeon_putc")});
+}
+
+// Prints length bytes of the string table starting at offset.
+inline void append_print_string(std::vector<Instr>& instrs, size_t offset, size_t length) {
+    instrs.push_back({.op = Op::mov, .a = reg_operand(Reg::rsi), .b = sym_operand("strings", static_cast<int64_t>(offset))});
+    instrs.push_back({.op = Op::mov, .a = reg_operand(Reg::rcx), .b = imm_operand(static_cast<int64_t>(length))});
+    instrs.push_back({.op = Op::call, .a = sym_operand("pigeon_puts")});
+}
+
+inline void append_flush(std::vector<Instr>& instrs) {
+    instrs.push_back({.op = Op::call, .a = sym_operand("pigeon_flush")});
+}
+
+// Ends the program with the exit code in rdi.
+inline void append_exit(std::vector<Instr>& instrs, bool prints, Target target) {
+    if (target == Target::jit) {
+        instrs.push_back({.op = Op::jmp, .a = sym_operand("pigeon_exit")});
+        return;
+    }
+    if (prints) {
+        append_flush(instrs);
+    }
+    instrs.push_back({.op = Op::mov, .a = reg_operand(Reg::rax), .b = imm_operand(60)});
+    instrs.push_back({.op = Op::syscall});
+}
+
+// The print routines, for code that uses them.
+inline void append_print_runtime(std::vector<Instr>& instrs) {
+    auto emit = [&](Op op, Operand a = {}, Operand b = {}) {
+        instrs.push_back({.op = op, .a = a, .b = b});
+    };
+    Operand rax = reg_operand(Reg::rax);
+    Operand rcx = reg_operand(Reg::rcx);
+    Operand rdx = reg_operand(Reg::rdx);
+    Operand rsi = reg_operand(Reg::rsi);
+    Operand rdi = reg_operand(Reg::rdi);
+    Operand position = mem_operand("outpos");
+    constexpr Reg saved[] = {Reg::rax, Reg::rcx, Reg::rdx, Reg::rsi, Reg::rdi, Reg::r11};
+
+    emit(Op::label, sym_operand("pigeon_putc"));
+    emit(Op::push, rdx);
+    emit(Op::mov, rdx, position);
+    emit(Op::mov, mem_operand("outbuf", Reg::rdx, 1), reg_operand(Reg::rax, 1));
+    emit(Op::add, rdx, imm_operand(1));
+    emit(Op::mov, position, rdx);
+    emit(Op::cmp, rdx, imm_operand(print_buffer_size));
+    emit(Op::jnz, sym_operand("pigeon_putc_done"));
+    emit(Op::call, sym_operand("pigeon_flush"));
+    emit(Op::label, sym_operand("pigeon_putc_done"));
+    emit(Op::pop, rdx);
+    emit(Op::ret);
+
+    // a run is copied into the buffer in one block; one that doesn't fit is preceded by
+    // a flush, and one at least as large as the buffer is written out directly
+    emit(Op::label, sym_operand("pigeon_puts"));
+    for (Reg reg : saved) {
+        emit(Op::push, reg_operand(reg));
+    }
+    emit(Op::mov, rdx, position);
+    emit(Op::add, rdx, rcx);
+    emit(Op::cmp, rdx, imm_operand(print_buffer_size));
+    emit(Op::jl, sym_operand("pigeon_puts_copy"));
+    emit(Op::call, sym_operand("pigeon_flush"));
+    emit(Op::cmp, rcx, imm_operand(print_buffer_size));
+    emit(Op::jl, sym_operand("pigeon_puts_copy"));
+    emit(Op::mov, rdx, rcx);
+    emit(Op::mov, rdi, imm_operand(1));
+    emit(Op::mov, rax, imm_operand(1));
+    emit(Op::syscall);
+    emit(Op::jmp, sym_operand("pigeon_puts_done"));
+    emit(Op::label, sym_operand("pigeon_puts_copy"));
+    emit(Op::mov, rdx, position);
+    emit(Op::mov, rdi, sym_operand("outbuf"));
+    emit(Op::add, rdi, rdx);
+    emit(Op::add, rdx, rcx);
+    emit(Op::mov, position, rdx);
+    emit(Op::rep_movsb);
+    emit(Op::label, sym_operand("pigeon_puts_done"));
+    for (auto reg = std::rbegin(saved); reg != std::rend(saved); ++reg) {
+        emit(Op::pop, reg_operand(*reg));
+    }
+    emit(Op::ret);
+
+    emit(Op::label, sym_operand("pigeon_flush"));
+    for (Reg reg : saved) {
+        emit(Op::push, reg_operand(reg));
+    }
+    emit(Op::mov, rdx, position);
+    emit(Op::test, rdx, rdx);
+    emit(Op::jz, sym_operand("pigeon_flush_done"));
+    emit(Op::mov, rsi, sym_operand("outbuf"));
+    emit(Op::mov, rdi, imm_operand(1));
+    emit(Op::mov, rax, imm_operand(1));
+    emit(Op::syscall);
+    emit(Op::mov, position, imm_operand(0));
+    emit(Op::label, sym_operand("pigeon_flush_done"));
+    for (auto reg = std::rbegin(saved); reg != std::rend(saved); ++reg) {
+        emit(Op::pop, reg_operand(*reg));
+    }
+    emit(Op::ret);
+}
+
+// pigeon_enter and pigeon_exit, for code run by --run.
+inline void append_jit_runtime(std::vector<Instr>& instrs, bool prints) {
+    auto emit = [&](Op op, Operand a = {}, Operand b = {}) {
+        instrs.push_back({.op = op, .a = a, .b = b});
+    };
+    Operand host_rsp = mem_operand("host_rsp");
+
+    emit(Op::label, sym_operand("pigeon_enter"));
+    for (Reg reg : local_regs) {
+        emit(Op::push, reg_operand(reg));
+    }
+    emit(Op::mov, host_rsp, reg_operand(Reg::rsp));
+    emit(Op::jmp, reg_operand(Reg::rdi));
+
+    emit(Op::label, sym_operand("pigeon_exit"));
+    if (prints) {
+        append_flush(instrs);
+    }
+    emit(Op::mov, reg_operand(Reg::rax), reg_operand(Reg::rdi));
+    emit(Op::mov, reg_operand(Reg::rsp), host_rsp);
+    for (auto reg = std::rbegin(local_regs); reg != std::rend(local_regs); ++reg) {
+        emit(Op::pop, reg_operand(*reg));
+    }
+    emit(Op::ret);
+}
+
+// Everything the code refers to after generation.
+inline void append_runtime(std::vector<Instr>& instrs, bool prints, Target target) {
+    if (prints) {
+        append_print_runtime(instrs);
+    }
+    if (target == Target::jit) {
+        append_jit_runtime(instrs, prints);
+    }
+}
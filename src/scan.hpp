@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Run scanners used by Tokenizer. Each one returns the first position in [p, end) that
+// doesn't belong to the run. With SSE2/AVX2 available whole blocks are classified at once,
+// the scalar loop handles the tail (and everything on other targets).
+
+[[nodiscard]] inline bool is_space_byte(uint8_t c) {
+    return c == ' ' || static_cast<uint8_t>(c - '\t') <= '\r' - '\t';
+}
+
+[[nodiscard]] inline bool is_digit_byte(uint8_t c) {
+    return static_cast<uint8_t>(c - '0') <= 9;
+}
+
+[[nodiscard]] inline bool is_alnum_byte(uint8_t c) {
+    return is_digit_byte(c) || static_cast<uint8_t>((c | 0x20) - 'a') <= 'z' - 'a';
+}
+
+#if defined(__AVX2__)
+using ScanVec = __m256i;
+constexpr size_t scan_width = 32;
+
+inline ScanVec scan_load(const char* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+inline ScanVec scan_splat(char c) { return _mm256_set1_epi8(c); }
+inline ScanVec scan_sub(ScanVec a, ScanVec b) { return _mm256_sub_epi8(a, b); }
+inline ScanVec scan_or(ScanVec a, ScanVec b) { return _mm256_or_si256(a, b); }
+inline ScanVec scan_eq(ScanVec a, ScanVec b) { return _mm256_cmpeq_epi8(a, b); }
+// unsigned a <= b, per byte
+inline ScanVec scan_le(ScanVec a, ScanVec b) { return _mm256_cmpeq_epi8(_mm256_min_epu8(a, b), a); }
+inline uint32_t scan_mask(ScanVec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+#elif defined(__SSE2__)
+using ScanVec = __m128i;
+constexpr size_t scan_width = 16;
+
+inline ScanVec scan_load(const char* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+inline ScanVec scan_splat(char c) { return _mm_set1_epi8(c); }
+inline ScanVec scan_sub(ScanVec a, ScanVec b) { return _mm_sub_epi8(a, b); }
+inline ScanVec scan_or(ScanVec a, ScanVec b) { return _mm_or_si128(a, b); }
+inline ScanVec scan_eq(ScanVec a, ScanVec b) { return _mm_cmpeq_epi8(a, b); }
+inline ScanVec scan_le(ScanVec a, ScanVec b) { return _mm_cmpeq_epi8(_mm_min_epu8(a, b), a); }
+inline uint32_t scan_mask(ScanVec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+#endif
+
+#if defined(__SSE2__)
+// Skips whole blocks matching pred. Only loads blocks that lie inside [p, end), so a
+// mapped file is never read past its last byte.
+template<typename Pred>
+[[nodiscard]] inline const char* scan_blocks(const char* p, const char* end, Pred pred) {
+    constexpr uint32_t full = static_cast<uint32_t>((uint64_t{1} << scan_width) - 1);
+    while (static_cast<size_t>(end - p) >= scan_width) {
+        uint32_t mask = scan_mask(pred(scan_load(p)));
+        if (mask != full) {
+            return p + __builtin_ctz(~mask);
+        }
+        p += scan_width;
+    }
+    return p;
+}
+
+inline ScanVec scan_is_digit(ScanVec c) {
+    return scan_le(scan_sub(c, scan_splat('0')), scan_splat(9));
+}
+#endif
+
+[[nodiscard]] inline const char* scan_space(const char* p, const char* end) {
+#if defined(__SSE2__)
+    p = scan_blocks(p, end, [](ScanVec c) {
+        return scan_or(scan_eq(c, scan_splat(' ')),
+                       scan_le(scan_sub(c, scan_splat('\t')), scan_splat('\r' - '\t')));
+    });
+#endif
+    while (p < end && is_space_byte(*p)) {
+        p++;
+    }
+    return p;
+}
+
+[[nodiscard]] inline const char* scan_digits(const char* p, const char* end) {
+#if defined(__SSE2__)
+    p = scan_blocks(p, end, scan_is_digit);
+#endif
+    while (p < end && is_digit_byte(*p)) {
+        p++;
+    }
+    return p;
+}
+
+[[nodiscard]] inline const char* scan_alnum(const char* p, const char* end) {
+#if defined(__SSE2__)
+    p = scan_blocks(p, end, [](ScanVec c) {
+        ScanVec folded = scan_or(c, scan_splat(0x20));
+        return scan_or(scan_is_digit(c),
+                       scan_le(scan_sub(folded, scan_splat('a')), scan_splat('z' - 'a')));
+    });
+#endif
+    while (p < end && is_alnum_byte(*p)) {
+        p++;
+    }
+    return p;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <csignal>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "./compiler.hpp"
+
+// Compile server. `pigeon --server <socket>` keeps one warm Compiler and serves requests
+// from `pigeon --client <socket> ...` over a Unix domain socket, one connection each:
+//   request:  "<input path>\n<output path>\n<opt level>[ emit-ir][ emit-asm]\n", then the
+//             client shuts down its write side
+//   response: "ok\n" or "error\n<message>"
+// Paths are made absolute by the client, the server's working directory doesn't matter.
+
+inline bool socket_address(const char* path, sockaddr_un& addr) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        std::cerr << "Socket path too long: " << path << std::endl;
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    return true;
+}
+
+inline std::string read_all(int fd) {
+    std::string data;
+    char buf[4096];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    return data;
+}
+
+inline void write_all(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(fd, data.data(), data.size());
+        if (n <= 0) {
+            return;
+        }
+        data.remove_prefix(n);
+    }
+}
+
+inline std::string serve_request(Compiler& compiler, const std::string& request) {
+    size_t input_end = request.find('\n');
+    size_t output_end = input_end == std::string::npos ? input_end : request.find('\n', input_end + 1);
+    if (output_end == std::string::npos) {
+        return "error\nMalformed request";
+    }
+    std::string input = request.substr(0, input_end);
+    std::string output = request.substr(input_end + 1, output_end - input_end - 1);
+    CompileOptions options;
+    options.opt_level = std::atoi(request.c_str() + output_end + 1);
+    options.emit_ir = request.find(" emit-ir", output_end) != std::string::npos;
+    options.emit_asm = request.find(" emit-asm", output_end) != std::string::npos;
+    try {
+        compiler.compile(input, output, options);
+    } catch (const std::exception& error) {
+        // not only CompileError: running out of memory or a file system error while serving
+        // one request mustn't take the server down for every client
+        return std::string("error\n") + error.what();
+    }
+    return "ok\n";
+}
+
+inline int run_server(const char* socket_path) {
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr)) {
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "Unable to listen on " << socket_path << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    Compiler compiler;
+    while (true) {
+        int conn = accept(listener, nullptr, nullptr);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "accept failed: " << strerror(errno) << std::endl;
+            break;
+        }
+        write_all(conn, serve_request(compiler, read_all(conn)));
+        close(conn);
+    }
+    close(listener);
+    unlink(socket_path);
+    return EXIT_FAILURE;
+}
+
+inline int run_client(const char* socket_path, const std::string& input, const std::string& output,
+                      const CompileOptions& options) {
+    sockaddr_un addr;
+    if (!socket_address(socket_path, addr)) {
+        return EXIT_FAILURE;
+    }
+    if (input.find('\n') != std::string::npos || output.find('\n') != std::string::npos) {
+        std::cerr << "Paths containing newlines can't be sent to the server" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string request = std::filesystem::absolute(input).string() + "\n"
+                        + std::filesystem::absolute(output).string() + "\n"
+                        + std::to_string(options.opt_level) + (options.emit_ir ? " emit-ir" : "")
+                        + (options.emit_asm ? " emit-asm\n" : "\n");
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (conn < 0 || connect(conn, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "Unable to connect to " << socket_path << ": " << strerror(errno) << std::endl;
+        return EXIT_FAILURE;
+    }
+    write_all(conn, request);
+    shutdown(conn, SHUT_WR);
+    std::string response = read_all(conn);
+    close(conn);
+    if (response == "ok\n") {
+        return EXIT_SUCCESS;
+    }
+    if (response.starts_with("error\n")) {
+        std::cerr << response.substr(6) << std::endl;
+    } else {
+        std::cerr << "Bad response from server" << std::endl;
+    }
+    return EXIT_FAILURE;
+}
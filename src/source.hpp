@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "./error.hpp"
+
+// Read-only view of an input file. Regular files are mapped straight into memory so the
+// tokenizer works on the page cache without copying, anything else (pipes, /dev/stdin)
+// falls back to reading into an owned buffer.
+class SourceFile {
+public:
+    inline explicit SourceFile(const char* path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            throw CompileError("Unable to open " + std::string(path));
+        }
+        struct stat st {};
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                m_map = static_cast<const char*>(map);
+                m_map_size = st.st_size;
+            }
+        }
+        if (m_map == nullptr) {
+            char buf[64 * 1024];
+            ssize_t n;
+            while ((n = read(fd, buf, sizeof(buf))) > 0) {
+                m_buffer.append(buf, n);
+            }
+        }
+        close(fd);
+    }
+
+    inline SourceFile(const SourceFile& other) = delete;
+
+    inline SourceFile& operator=(const SourceFile& other) = delete;
+
+    inline ~SourceFile() {
+        if (m_map != nullptr) {
+            munmap(const_cast<char*>(m_map), m_map_size);
+        }
+    }
+
+    [[nodiscard]] inline std::string_view view() const {
+        if (m_map != nullptr) {
+            return {m_map, m_map_size};
+        }
+        return m_buffer;
+    }
+
+private:
+    const char* m_map = nullptr;
+    size_t m_map_size = 0;
+    std::string m_buffer;
+};
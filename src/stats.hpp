@@ -0,0 +1,176 @@
+#pragma once
+
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <sys/resource.h>
+#include <utility>
+#include <vector>
+
+// What one compile spent and produced, for --time-passes and --stats=json. Times are
+// wall clock and the calling thread's CPU time, so compiles running on parallel workers
+// don't count each other's work.
+struct PassTime {
+    const char* name;
+    double wall_ms;
+    double cpu_ms;
+};
+
+struct CompileStats {
+    std::vector<PassTime> passes;
+    size_t source_bytes = 0;
+    size_t tokens = 0;
+    size_t ast_nodes = 0;
+    size_t ast_list_entries = 0;
+    size_t ast_bytes = 0;           // nodes and list entries in use
+    size_t ast_reserved_bytes = 0;  // capacity of the AST buffers: the high-water mark, since they are reused
+    size_t ir_instrs = 0;
+    size_t instrs = 0;
+    size_t code_bytes = 0;
+    size_t data_bytes = 0;          // the string table
+    bool cached = false;            // outputs came from the cache, nothing after "read" ran
+
+    inline void clear() {
+        *this = {};
+    }
+};
+
+// Splits a compile into passes: lap(name) charges everything since the previous lap (or
+// since construction) to name. Does nothing without stats, so the pipeline can always
+// call it.
+class PassClock {
+public:
+    inline explicit PassClock(CompileStats* stats) : m_stats(stats) {
+        if (m_stats != nullptr) {
+            m_wall = now(CLOCK_MONOTONIC);
+            m_cpu = now(CLOCK_THREAD_CPUTIME_ID);
+        }
+    }
+
+    inline void lap(const char* name) {
+        if (m_stats == nullptr) {
+            return;
+        }
+        double wall = now(CLOCK_MONOTONIC);
+        double cpu = now(CLOCK_THREAD_CPUTIME_ID);
+        m_stats->passes.push_back({.name = name, .wall_ms = wall - m_wall, .cpu_ms = cpu - m_cpu});
+        m_wall = wall;
+        m_cpu = cpu;
+    }
+
+    // Milliseconds on clock.
+    static inline double now(clockid_t clock) {
+        timespec ts {};
+        clock_gettime(clock, &ts);
+        return static_cast<double>(ts.tv_sec) * 1e3 + static_cast<double>(ts.tv_nsec) / 1e6;
+    }
+
+private:
+    CompileStats* m_stats;
+    double m_wall = 0;
+    double m_cpu = 0;
+};
+
+inline long peak_rss_kib() {
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// User and system time of the whole process, every thread included.
+inline double process_cpu_ms() {
+    rusage usage {};
+    getrusage(RUSAGE_SELF, &usage);
+    auto ms = [](timeval tv) {
+        return static_cast<double>(tv.tv_sec) * 1e3 + static_cast<double>(tv.tv_usec) / 1e3;
+    };
+    return ms(usage.ru_utime) + ms(usage.ru_stime);
+}
+
+inline void append_ms(std::string& out, double ms) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.3f", ms);
+    out += buf;
+}
+
+// Table for --time-passes, one line per pass and one with the counts.
+inline std::string format_stats(const CompileStats& stats) {
+    std::string out;
+    double wall = 0;
+    double cpu = 0;
+    for (const PassTime& pass : stats.passes) {
+        char line[96];
+        snprintf(line, sizeof(line), "  %-10s %10.3f ms wall %10.3f ms cpu\n", pass.name, pass.wall_ms, pass.cpu_ms);
+        out += line;
+        wall += pass.wall_ms;
+        cpu += pass.cpu_ms;
+    }
+    char line[96];
+    snprintf(line, sizeof(line), "  %-10s %10.3f ms wall %10.3f ms cpu\n", "total", wall, cpu);
+    out += line;
+    if (stats.cached) {
+        out += "  " + std::to_string(stats.source_bytes) + " bytes of source, outputs from the cache";
+        return out;
+    }
+    out += "  " + std::to_string(stats.source_bytes) + " bytes of source, " + std::to_string(stats.tokens)
+        + " tokens, " + std::to_string(stats.ast_nodes) + " AST nodes, " + std::to_string(stats.ast_list_entries)
+        + " list entries (" + std::to_string(stats.ast_bytes) + " bytes, " + std::to_string(stats.ast_reserved_bytes)
+        + " reserved)\n  " + std::to_string(stats.ir_instrs) + " IR instructions, " + std::to_string(stats.instrs)
+        + " instructions, " + std::to_string(stats.code_bytes) + " bytes of code, " + std::to_string(stats.data_bytes)
+        + " bytes of data";
+    return out;
+}
+
+inline void append_json_string(std::string& out, std::string_view text) {
+    out += '"';
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// One JSON object per compile, for --stats=json.
+inline void append_json(std::string& out, std::string_view input, const CompileStats& stats) {
+    out += "{\"input\": ";
+    append_json_string(out, input);
+    out += ", \"passes\": [";
+    for (size_t i = 0; i < stats.passes.size(); i++) {
+        out += i == 0 ? "{\"name\": " : ", {\"name\": ";
+        append_json_string(out, stats.passes[i].name);
+        out += ", \"wall_ms\": ";
+        append_ms(out, stats.passes[i].wall_ms);
+        out += ", \"cpu_ms\": ";
+        append_ms(out, stats.passes[i].cpu_ms);
+        out += "}";
+    }
+    out += "], \"cached\": ";
+    out += stats.cached ? "true" : "false";
+    const std::pair<const char*, size_t> counts[] = {
+        {"source_bytes", stats.source_bytes},
+        {"tokens", stats.tokens},
+        {"ast_nodes", stats.ast_nodes},
+        {"ast_list_entries", stats.ast_list_entries},
+        {"ast_bytes", stats.ast_bytes},
+        {"ast_reserved_bytes", stats.ast_reserved_bytes},
+        {"ir_instrs", stats.ir_instrs},
+        {"instrs", stats.instrs},
+        {"code_bytes", stats.code_bytes},
+        {"data_bytes", stats.data_bytes},
+    };
+    for (const auto& [name, count] : counts) {
+        out += ", \"";
+        out += name;
+        out += "\": " + std::to_string(count);
+    }
+    out += "}";
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using SymbolId = uint32_t;
+
+// Maps every distinct identifier to a dense integer id. Names are views into the source,
+// so the interner must not outlive it.
+class Interner {
+public:
+    inline SymbolId intern(std::string_view name) {
+        auto [it, inserted] = m_ids.try_emplace(name, static_cast<SymbolId>(m_names.size()));
+        if (inserted) {
+            m_names.push_back(name);
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] inline std::string_view name(SymbolId id) const {
+        return m_names[id];
+    }
+
+    [[nodiscard]] inline size_t size() const {
+        return m_names.size();
+    }
+
+    inline void clear() {
+        m_ids.clear();
+        m_names.clear();
+    }
+
+private:
+    std::unordered_map<std::string_view, SymbolId> m_ids;
+    std::vector<std::string_view> m_names;
+};
+
+// Block-scoped bindings keyed by SymbolId. A name can only be bound once while it is
+// visible, so a flat slot per symbol gives O(1) lookup; scopes remember how many bindings
+// existed when they were opened and unbind everything above that on close.
+template<typename T>
+class ScopedSymbolTable {
+public:
+    [[nodiscard]] inline T* lookup(SymbolId id) {
+        if (id >= m_slots.size() || m_slots[id] == 0) {
+            return nullptr;
+        }
+        return &m_bindings[m_slots[id] - 1].second;
+    }
+
+    // Returns false if the name is already bound in a visible scope.
+    inline bool declare(SymbolId id, T value) {
+        if (id >= m_slots.size()) {
+            m_slots.resize(id + 1, 0);
+        }
+        if (m_slots[id] != 0) {
+            return false;
+        }
+        m_bindings.emplace_back(id, std::move(value));
+        m_slots[id] = static_cast<uint32_t>(m_bindings.size());
+        return true;
+    }
+
+    inline void begin_scope() {
+        m_scopes.push_back(m_bindings.size());
+    }
+
+    // Closes the innermost scope and returns how many bindings it dropped.
+    inline size_t end_scope() {
+        size_t count = m_bindings.size() - m_scopes.back();
+        for (size_t i = 0; i < count; i++) {
+            m_slots[m_bindings.back().first] = 0;
+            m_bindings.pop_back();
+        }
+        m_scopes.pop_back();
+        return count;
+    }
+
+    inline void clear() {
+        m_slots.clear();
+        m_bindings.clear();
+        m_scopes.clear();
+    }
+
+private:
+    std::vector<uint32_t> m_slots;
+    std::vector<std::pair<SymbolId, T>> m_bindings;
+    std::vector<size_t> m_scopes;
+};
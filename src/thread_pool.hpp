@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// Fixed set of workers, each with its own task deque. A worker takes tasks from the back
+// of its own deque and, once that runs dry, steals from the front of the others, so a few
+// slow tasks don't leave the remaining threads idle.
+class WorkStealingPool {
+public:
+    inline explicit WorkStealingPool(size_t threads) : m_queues(std::max<size_t>(threads, 1)) {
+    }
+
+    [[nodiscard]] inline size_t threads() const {
+        return m_queues.size();
+    }
+
+    // Runs task(worker, i) for every i in [0, count) and returns once all are done.
+    // worker is in [0, threads()) and identifies the calling thread, for per-thread state.
+    template<typename Task>
+    inline void run(size_t count, Task task) {
+        size_t workers = std::min(threads(), std::max<size_t>(count, 1));
+        for (size_t i = 0; i < count; i++) {
+            // contiguous chunks, so neighbouring tasks start out on the same worker
+            m_queues[i * workers / count].tasks.push_back(i);
+        }
+        std::vector<std::thread> pool;
+        for (size_t worker = 1; worker < workers; worker++) {
+            pool.emplace_back([this, worker, workers, &task] { work(worker, workers, task); });
+        }
+        work(0, workers, task);
+        for (std::thread& thread : pool) {
+            thread.join();
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    template<typename Task>
+    inline void work(size_t worker, size_t workers, Task& task) {
+        while (auto index = next_task(worker, workers)) {
+            task(worker, index.value());
+        }
+    }
+
+    inline std::optional<size_t> next_task(size_t worker, size_t workers) {
+        {
+            Queue& own = m_queues[worker];
+            std::lock_guard lock(own.mutex);
+            if (!own.tasks.empty()) {
+                size_t index = own.tasks.back();
+                own.tasks.pop_back();
+                return index;
+            }
+        }
+        // No task creates new tasks, so once every queue is empty we are done.
+        for (size_t i = 1; i < workers; i++) {
+            Queue& victim = m_queues[(worker + i) % workers];
+            std::lock_guard lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                size_t index = victim.tasks.front();
+                victim.tasks.pop_front();
+                return index;
+            }
+        }
+        return {};
+    }
+
+    std::vector<Queue> m_queues;
+};
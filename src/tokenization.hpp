@@ -1,8 +1,14 @@
 #pragma once
 
-#include <string>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string_view>
 #include <vector>
-enum class TokenType {
+#include "./error.hpp"
+#include "./scan.hpp"
+#include "./symbols.hpp"
+enum class TokenType : uint8_t {
     exit,
     int_lit,
     semi,
@@ -20,8 +26,15 @@ enum class TokenType {
     open_curly,
     close_curly,
     if_,
+    while_,
     apo,
-    bslash
+    bslash,
+    eq_eq,
+    bang_eq,
+    lt,
+    lt_eq,
+    gt,
+    gt_eq
 };
 
 bool is_bin_op(TokenType type) {
@@ -30,20 +43,35 @@ bool is_bin_op(TokenType type) {
         case TokenType::star:
         case TokenType::minus:
         case TokenType::slash:
+        case TokenType::eq_eq:
+        case TokenType::bang_eq:
+        case TokenType::lt:
+        case TokenType::lt_eq:
+        case TokenType::gt:
+        case TokenType::gt_eq:
             return true;
         default:
             return false;
     }
 }
 
+// As in C: equality binds loosest, then ordering, then + and -, then * and /.
 std::optional<int> get_prec(TokenType type) {
     switch (type) {
+        case TokenType::eq_eq:
+        case TokenType::bang_eq:
+            return 0;
+        case TokenType::lt:
+        case TokenType::lt_eq:
+        case TokenType::gt:
+        case TokenType::gt_eq:
+            return 1;
         case TokenType::minus:
         case TokenType::plus:
-            return 0;
+            return 2;
         case TokenType::slash:
         case TokenType::star:
-            return 1;
+            return 3;
         default:
             return {};
     }
@@ -51,133 +79,243 @@ std::optional<int> get_prec(TokenType type) {
 
 
 
+// Tokens don't own their text, ident and int_lit tokens point back into the source.
+// value is the length of an int_lit and the interned symbol of an ident, which is all
+// the parser needs; an identifier's length is only scanned again for char literals.
 struct Token {
     TokenType type;
-    std::optional<std::string> value;
+    uint32_t offset = 0;
+    uint32_t value = 0;
+
+    [[nodiscard]] inline SymbolId sym() const {
+        return value;
+    }
+
+    [[nodiscard]] inline std::string_view text(std::string_view src) const {
+        if (type == TokenType::ident) {
+            const char* start = src.data() + offset;
+            return {start, static_cast<size_t>(scan_alnum(start + 1, src.data() + src.size()) - start)};
+        }
+        return src.substr(offset, value);
+    }
 };
+static_assert(sizeof(Token) <= 12);
+
+enum class CharClass : uint8_t {
+    invalid,
+    space,
+    alpha,
+    digit,
+    punct
+};
+
+struct CharTables {
+    std::array<CharClass, 256> cls {};
+    std::array<TokenType, 256> punct {};
+    std::array<std::optional<TokenType>, 256> punct_eq {};  // the token for this char followed by '='
+};
+
+inline constexpr CharTables make_char_tables() {
+    CharTables tables {};
+    for (char c : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+        tables.cls[static_cast<uint8_t>(c)] = CharClass::space;
+    }
+    for (int c = 'a'; c <= 'z'; c++) {
+        tables.cls[c] = CharClass::alpha;
+        tables.cls[c - 'a' + 'A'] = CharClass::alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        tables.cls[c] = CharClass::digit;
+    }
+    const std::pair<char, TokenType> puncts[] = {
+        {'(', TokenType::open_paren}, {')', TokenType::close_paren},
+        {'{', TokenType::open_curly}, {'}', TokenType::close_curly},
+        {'\'', TokenType::apo}, {'\\', TokenType::bslash},
+        {'=', TokenType::eq}, {';', TokenType::semi}, {',', TokenType::comma},
+        {'+', TokenType::plus}, {'-', TokenType::minus},
+        {'*', TokenType::star}, {'/', TokenType::slash},
+        {'<', TokenType::lt}, {'>', TokenType::gt}, {'!', TokenType::bang_eq},
+    };
+    for (auto [c, type] : puncts) {
+        tables.cls[static_cast<uint8_t>(c)] = CharClass::punct;
+        tables.punct[static_cast<uint8_t>(c)] = type;
+    }
+    const std::pair<char, TokenType> puncts_eq[] = {
+        {'=', TokenType::eq_eq}, {'!', TokenType::bang_eq}, {'<', TokenType::lt_eq}, {'>', TokenType::gt_eq},
+    };
+    for (auto [c, type] : puncts_eq) {
+        tables.punct_eq[static_cast<uint8_t>(c)] = type;
+    }
+    return tables;
+}
+
+inline constexpr CharTables char_tables = make_char_tables();
+
+struct Keyword {
+    std::string_view text;
+    TokenType type;
+};
+
+inline constexpr Keyword keywords[] = {
+    {"exit", TokenType::exit},
+    {"let", TokenType::let},
+    {"print", TokenType::print},
+    {"if", TokenType::if_},
+    {"while", TokenType::while_},
+};
+
+// first + last character happens to be collision free for the keywords, checked below
+[[nodiscard]] inline constexpr size_t keyword_hash(std::string_view word) {
+    return (static_cast<uint8_t>(word.front()) + static_cast<uint8_t>(word.back())) & 15;
+}
+
+inline constexpr std::array<std::optional<Keyword>, 16> make_keyword_table() {
+    std::array<std::optional<Keyword>, 16> table {};
+    for (const Keyword& keyword : keywords) {
+        table[keyword_hash(keyword.text)] = keyword;
+    }
+    return table;
+}
+
+inline constexpr std::array<std::optional<Keyword>, 16> keyword_table = make_keyword_table();
+
+inline constexpr bool keyword_hash_is_perfect() {
+    size_t used = 0;
+    for (const auto& slot : keyword_table) {
+        used += slot.has_value();
+    }
+    return used == std::size(keywords);
+}
+static_assert(keyword_hash_is_perfect(), "keyword_hash collides, pick another hash");
+
 class Tokenizer {
 public:
-    inline explicit Tokenizer(std::string& src) : m_src(std::move(src))
+    inline explicit Tokenizer(std::string_view src, Interner& interner) : m_src(src), m_interner(interner)
     {
+        if (m_src.size() > UINT32_MAX) {
+            throw CompileError("Input too large.");
+        }
     }
 
     inline std::vector<Token> tokenize() {
         std::vector<Token> tokens;
-        std::string buf;
-        while (peak().has_value()) {
-            if (std::isalpha(peak().value())) {
-                buf.push_back(consume());
-                while (peak().has_value() && std::isalnum(peak().value())) {
-                    buf.push_back(consume());
-                }
-                if (buf == "exit") {
-                    tokens.push_back({.type = TokenType::exit});
-                    buf.clear();
-                } else if (buf == "let") {
-                    tokens.push_back({.type =  TokenType::let});
-                    buf.clear();
-                } else if (buf == "print") {
-                    tokens.push_back({.type =  TokenType::print});
-                    buf.clear();
-                } else if (buf == "if") {
-                    tokens.push_back({.type =  TokenType::if_});
-                    buf.clear();
+        while (auto token = next()) {
+            tokens.push_back(token.value());
+        }
+        return tokens;
+    }
+
+    // Pulls the next token, or nothing once the source is exhausted.
+    inline std::optional<Token> next() {
+        const char* const begin = m_src.data();
+        const char* const end = begin + m_src.size();
+        while (m_cur < end) {
+            switch (char_tables.cls[static_cast<uint8_t>(*m_cur)]) {
+                case CharClass::space:
+                    m_cur = scan_space(m_cur + 1, end);
+                    break;
+                case CharClass::alpha: {
+                    const char* start = m_cur;
+                    m_cur = scan_alnum(m_cur + 1, end);
+                    std::string_view word(start, m_cur - start);
+                    if (auto keyword = lookup_keyword(word)) {
+                        return Token {.type = keyword.value()};
+                    }
+                    return Token {.type = TokenType::ident,
+                        .offset = static_cast<uint32_t>(start - begin),
+                        .value = m_interner.intern(word)};
                 }
-                else {
-                    tokens.push_back({.type = TokenType::ident, .value = buf});
-                    buf.clear();
+                case CharClass::digit: {
+                    const char* start = m_cur;
+                    m_cur = scan_digits(m_cur + 1, end);
+                    return Token {.type = TokenType::int_lit,
+                        .offset = static_cast<uint32_t>(start - begin),
+                        .value = static_cast<uint32_t>(m_cur - start)};
                 }
-            }
-            else if (std::isdigit(peak().value())) {
-                buf.push_back(consume());
-                while (peak().has_value() && std::isdigit(peak().value())) {
-                    buf.push_back(consume());
+                case CharClass::punct: {
+                    auto c = static_cast<uint8_t>(*m_cur++);
+                    if (m_cur < end && *m_cur == '=' && char_tables.punct_eq[c].has_value()) {
+                        m_cur++;
+                        return Token {.type = char_tables.punct_eq[c].value()};
+                    }
+                    if (c == '!') {
+                        throw CompileError("Expected '=' after '!'.");
+                    }
+                    return Token {.type = char_tables.punct[c]};
                 }
-                tokens.push_back({.type = TokenType::int_lit, .value = buf});
-                buf.clear();
-            }
-            else if (peak().value() == '(') {
-                consume();
-                tokens.push_back({.type = TokenType::open_paren});
-            } else if (peak().value() == '\'') {
-                consume();
-                tokens.push_back({.type = TokenType::apo});
-            }
-            else if (peak().value() == '\\') {
-                consume();
-                tokens.push_back({.type = TokenType::bslash});
-            }
-            else if (peak().value() == '=') {
-                consume();
-                tokens.push_back({.type = TokenType::eq});
-            }
-            else if (peak().value() == ')') {
-                consume();
-                tokens.push_back({.type = TokenType::close_paren});
-            }
-            else if (peak().value() == '{') {
-                consume();
-                tokens.push_back({.type = TokenType::open_curly});
-            }
-            else if (peak().value() == '}') {
-                consume();
-                tokens.push_back({.type = TokenType::close_curly});
-            }
-            else if (peak().value() == ';') {
-                consume();
-                tokens.push_back({.type = TokenType::semi});
-                buf.clear();
-            } else if (peak().value() == '+') {
-                consume();
-                tokens.push_back({.type = TokenType::plus});
-                buf.clear();
-            }
-            else if (peak().value() == '*') {
-                consume();
-                tokens.push_back({.type = TokenType::star});
-                buf.clear();
-            }
-            else if (peak().value() == '/') {
-                consume();
-                tokens.push_back({.type = TokenType::slash});
-                buf.clear();
-            }
-            else if (peak().value() == ',') {
-                consume();
-                tokens.push_back({.type = TokenType::comma});
-                buf.clear();
-            }
-            else if (peak().value() == '-') {
-                consume();
-                tokens.push_back({.type = TokenType::minus});
-                buf.clear();
-            }
-            else if (std::isspace(peak().value())) {
-                consume();
-            }
-            else {
-                std::cerr << "Messed up" << std::endl;
-                exit(EXIT_FAILURE);
+                case CharClass::invalid:
+                    throw CompileError("Messed up");
             }
         }
-        m_index =  0;
-        return tokens;
+        return {};
     }
 private:
+    [[nodiscard]] static inline std::optional<TokenType> lookup_keyword(std::string_view word) {
+        const auto& slot = keyword_table[keyword_hash(word)];
+        if (slot.has_value() && slot->text == word) {
+            return slot->type;
+        }
+        return {};
+    }
 
-    [[nodiscard]] inline std::optional<char> peak(int offset = 0) const {
-        if (m_index + offset >= m_src.length()) {
-            return {};
+    const std::string_view m_src;
+    const char* m_cur = m_src.data();
+    Interner& m_interner;
+};
+
+// Lookahead window the parser reads tokens through. It is either backed by a fully
+// tokenized vector or pulls from a Tokenizer on demand, in which case only the
+// lookahead ring is ever resident.
+class TokenStream {
+public:
+    static constexpr size_t lookahead = 2;
+
+    inline explicit TokenStream(std::vector<Token> tokens) : m_tokens(std::move(tokens)) {
+    }
+
+    inline explicit TokenStream(Tokenizer& tokenizer) : m_tokenizer(&tokenizer) {
+    }
+
+    [[nodiscard]] inline std::optional<Token> peek(size_t offset = 0) {
+        if (m_tokenizer == nullptr) {
+            if (m_index + offset >= m_tokens.size()) {
+                return {};
+            }
+            return m_tokens[m_index + offset];
         }
-        else {
-            return m_src.at(m_index + offset);
+        while (m_count <= offset) {
+            auto token = m_tokenizer->next();
+            if (!token.has_value()) {
+                return {};
+            }
+            m_ring[(m_head + m_count++) % m_ring.size()] = token.value();
+            m_pulled++;
         }
+        return m_ring[(m_head + offset) % m_ring.size()];
     }
 
-    inline char consume() {
-        return m_src.at(m_index++);
+    inline Token consume() {
+        if (m_tokenizer == nullptr) {
+            return m_tokens.at(m_index++);
+        }
+        (void)peek();
+        Token token = m_ring[m_head];
+        m_head = (m_head + 1) % m_ring.size();
+        m_count--;
+        return token;
+    }
+
+    // Tokens read so far, for statistics.
+    [[nodiscard]] inline size_t token_count() const {
+        return m_tokenizer == nullptr ? m_tokens.size() : m_pulled;
     }
 
-    const std::string m_src;
-    size_t m_index=0;
+private:
+    std::vector<Token> m_tokens;
+    size_t m_index = 0;
+    Tokenizer* m_tokenizer = nullptr;
+    std::array<Token, lookahead> m_ring {};
+    size_t m_head = 0;
+    size_t m_count = 0;
+    size_t m_pulled = 0;
 };
\ No newline at end of file
@@ -0,0 +1,251 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// General purpose registers, numbered as in the instruction encoding.
+enum class Reg : uint8_t {
+    rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi,
+    r8, r9, r10, r11, r12, r13, r14, r15
+};
+
+inline std::string_view reg_name(Reg reg) {
+    constexpr std::string_view names[] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"
+    };
+    return names[static_cast<uint8_t>(reg)];
+}
+
+// Name of the low `size` bytes of a register.
+inline std::string_view reg_name(Reg reg, uint8_t size) {
+    constexpr std::string_view dword_names[] = {
+        "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d"
+    };
+    constexpr std::string_view byte_names[] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"
+    };
+    switch (size) {
+        case 4:
+            return dword_names[static_cast<uint8_t>(reg)];
+        case 1:
+            return byte_names[static_cast<uint8_t>(reg)];
+        default:
+            return reg_name(reg);
+    }
+}
+
+// Registers that survive a syscall (the kernel only clobbers rax, rcx and r11), used for
+// variables that are kept in registers.
+inline constexpr Reg local_regs[] = {Reg::rbx, Reg::rbp, Reg::r12, Reg::r13, Reg::r14, Reg::r15};
+
+// Scratch registers for expression temporaries. rax and rdx are left out: they are only
+// ever used inside a single instruction sequence (division, syscall setup), so they are
+// always free as a second operand.
+inline constexpr Reg temp_regs[] = {Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10, Reg::r11};
+
+// The generator builds a list of Instr rather than text, so later passes can inspect and
+// rewrite it. An operand is a register, an immediate, a memory reference
+// ([base + index*scale + disp] or [symbol + disp]), a code label, or the address of a
+// data symbol.
+struct Operand {
+    enum class Kind : uint8_t { none, reg, imm, mem, label, sym };
+
+    Kind kind = Kind::none;
+    uint8_t size = 8;           // width in bytes of reg and mem operands, 0 for lea's
+    Reg reg = Reg::rax;         // reg, or the base of a mem without a symbol
+    Reg index = Reg::rax;       // index of a mem, if scale isn't 0
+    uint8_t scale = 0;
+    int64_t value = 0;          // imm, mem displacement or label number
+    std::string_view sym {};    // symbol of sym and of symbolic mem operands
+
+    [[nodiscard]] inline bool is_reg(Reg r) const {
+        return kind == Kind::reg && reg == r;
+    }
+
+    // Does reading this operand read register r (as a value or as an address)?
+    [[nodiscard]] inline bool mentions(Reg r) const {
+        if (kind == Kind::mem) {
+            return (sym.empty() && reg == r) || (scale != 0 && index == r);
+        }
+        return kind == Kind::reg && reg == r;
+    }
+
+    bool operator==(const Operand& other) const = default;
+};
+
+inline Operand reg_operand(Reg reg, uint8_t size = 8) {
+    return {.kind = Operand::Kind::reg, .size = size, .reg = reg};
+}
+
+inline Operand imm_operand(int64_t value) {
+    return {.kind = Operand::Kind::imm, .value = value};
+}
+
+inline Operand mem_operand(Reg base, int64_t disp, uint8_t size = 8) {
+    return {.kind = Operand::Kind::mem, .size = size, .reg = base, .value = disp};
+}
+
+inline Operand mem_operand(Reg base, Reg index, uint8_t scale, int64_t disp, uint8_t size = 8) {
+    return {.kind = Operand::Kind::mem, .size = size, .reg = base, .index = index, .scale = scale, .value = disp};
+}
+
+inline Operand mem_operand(std::string_view sym, uint8_t size = 8) {
+    return {.kind = Operand::Kind::mem, .size = size, .sym = sym};
+}
+
+inline Operand mem_operand(std::string_view sym, Reg index, uint8_t size) {
+    return {.kind = Operand::Kind::mem, .size = size, .index = index, .scale = 1, .sym = sym};
+}
+
+inline Operand label_operand(uint32_t label) {
+    return {.kind = Operand::Kind::label, .value = label};
+}
+
+inline Operand sym_operand(std::string_view sym, int64_t offset = 0) {
+    return {.kind = Operand::Kind::sym, .value = offset, .sym = sym};
+}
+
+inline bool fits_imm32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+// `label` defines label a (numbered, or named by a symbol) and `align` pads with no-ops to
+// a multiple of a bytes; every other op is the instruction of that name. imul takes one
+// operand (rdx:rax = rax * a), two, or three with an immediate in c. The setcc and jcc ops
+// are in Cond order.
+enum class Op : uint8_t {
+    label, align, mov, movzx, push, pop, lea, add, sub, neg, imul, mul, div, idiv, cqo, xor_, shl, sar, shr,
+    cmp, test, sete, setne, setl, setge, setle, setg, jz, jnz, jl, jge, jle, jg, jmp, call, ret, syscall,
+    rep_movsb
+};
+
+// Signed conditions, paired so that flipping the low bit negates one.
+enum class Cond : uint8_t { e, ne, l, ge, le, g };
+
+inline Cond negate(Cond cond) {
+    return static_cast<Cond>(static_cast<uint8_t>(cond) ^ 1);
+}
+
+// Jump if cond holds.
+inline Op jump_op(Cond cond) {
+    return static_cast<Op>(static_cast<uint8_t>(Op::jz) + static_cast<uint8_t>(cond));
+}
+
+// Set a byte register to whether cond holds.
+inline Op set_op(Cond cond) {
+    return static_cast<Op>(static_cast<uint8_t>(Op::sete) + static_cast<uint8_t>(cond));
+}
+
+struct Instr {
+    Op op;
+    Operand a {};
+    Operand b {};
+    Operand c {};
+};
+
+// What code is generated for.
+enum class Target : uint8_t {
+    executable, // a standalone program
+    jit,        // called in the compiler's process by --run
+};
+
+// What a code generator produces: the code, plus the data it refers to (runtime.hpp).
+struct Assembly {
+    std::vector<Instr> instrs;
+    bool prints = false;    // uses the output buffer
+    std::string strings;    // string table of constant print runs
+    Target target = Target::executable;
+};
+
+inline std::string_view op_name(Op op) {
+    constexpr std::string_view names[] = {
+        "", "align", "mov", "movzx", "push", "pop", "lea", "add", "sub", "neg", "imul", "mul", "div", "idiv", "cqo",
+        "xor", "shl", "sar", "shr", "cmp", "test", "sete", "setne", "setl", "setge", "setle", "setg",
+        "jz", "jnz", "jl", "jge", "jle", "jg", "jmp", "call", "ret", "syscall", "rep movsb"
+    };
+    return names[static_cast<uint8_t>(op)];
+}
+
+inline void append_int(std::string& out, int64_t value) {
+    char buf[24];
+    auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+    out.append(buf, end);
+}
+
+inline void append_operand(std::string& out, const Operand& operand) {
+    switch (operand.kind) {
+        case Operand::Kind::reg:
+            out += reg_name(operand.reg, operand.size);
+            break;
+        case Operand::Kind::imm:
+            append_int(out, operand.value);
+            break;
+        case Operand::Kind::mem:
+            out += operand.size == 8 ? "QWORD [" : operand.size == 4 ? "DWORD [" : operand.size == 1 ? "BYTE [" : "[";
+            if (operand.sym.empty()) {
+                out += reg_name(operand.reg);
+                if (operand.scale != 0) {
+                    out += " + ";
+                    out += reg_name(operand.index);
+                    out += "*";
+                    append_int(out, operand.scale);
+                }
+                if (operand.scale == 0 || operand.value != 0) {
+                    out += " + ";
+                    append_int(out, operand.value);
+                }
+            } else {
+                out += operand.sym;
+                if (operand.scale != 0) {
+                    out += " + ";
+                    out += reg_name(operand.index);
+                    out += "*";
+                    append_int(out, operand.scale);
+                }
+                if (operand.value != 0) {
+                    out += " + ";
+                    append_int(out, operand.value);
+                }
+            }
+            out += "]";
+            break;
+        case Operand::Kind::label:
+            out += "label";
+            append_int(out, operand.value);
+            break;
+        case Operand::Kind::sym:
+            out += operand.sym;
+            if (operand.value != 0) {
+                out += " + ";
+                append_int(out, operand.value);
+            }
+            break;
+        case Operand::Kind::none:
+            break;
+    }
+}
+
+// Appends one line of NASM source.
+inline void append_instr(std::string& out, const Instr& instr) {
+    if (instr.op == Op::label) {
+        append_operand(out, instr.a);
+        out += ":\n";
+        return;
+    }
+    out += "    ";
+    out += op_name(instr.op);
+    for (const Operand* operand : {&instr.a, &instr.b, &instr.c}) {
+        if (operand->kind == Operand::Kind::none) {
+            break;
+        }
+        out += operand == &instr.a ? " " : ", ";
+        append_operand(out, *operand);
+    }
+    out += "\n";
+}